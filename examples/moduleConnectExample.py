@@ -13,6 +13,7 @@ class ObjectTrackerModule(ALModule):
         self.gestureProxy = ALProxy("NAOObjectGesture", myBroker)
         self.motionProxy = ALProxy("ALMotion", myBroker)
         self.memProxy = ALProxy("ALMemory", myBroker)
+        self.kindNames = []
 
         self.motionProxy.setStiffnesses("Head", 1.0)
         self.gestureProxy.startTracker(15, 0)
@@ -30,8 +31,10 @@ class ObjectTrackerModule(ALModule):
         self.gestureProxy.stopFocus()
 
     def load(self, path, name):
-        self.gestureProxy.loadDataset(path)
-        self.gestureProxy.trackObject(name, -len(self.kindNames))
+        # the kind id is reserved right away, the model is loaded in the background and detected once it is ready
+        kindId = self.gestureProxy.loadDataset(path)
+        self.kindNames.append(name)
+        self.gestureProxy.trackObject(name, kindId)
         self.memProxy.subscribeToMicroEvent(name, "ObjectTracker", name, "onObjGet")
 
     def onObjGet(self, key, value, message):
@@ -50,7 +53,7 @@ class ObjectTrackerModule(ALModule):
 
     def unload(self):
         self.gestureProxy.stopTracker()
-        for i in range(0, len(self.exists)):
+        for i in range(0, len(self.kindNames)):
             self.gestureProxy.removeObjectKind(0)
             self.gestureProxy.removeEvent(self.kindNames[i])
         self.gestureProxy.removeGesture("Drink")
@@ -51,12 +51,16 @@ class NAOCamera : public ImageAcquisition{
         AL::ALVideoDeviceProxy camproxy;
         /*! Subscriber name*/
         std::string clientName;
+        /*! True if subscribed in the camera's native YUV422 format*/
+        bool yuv422;
     public:
         /*! Standard constructor.
           * \param IP IP of NAO to connect to.
           * \param port Port over which to connect
+          * \param chromaOnly If true, subscribes in YUV422 and getImage returns the two-channel Cr/Cb image,
+          *     see yuv422Chroma. Otherwise getImage returns a BGR image.
           */
-        NAOCamera(const std::string IP, int port);
+        NAOCamera(const std::string IP, int port, bool chromaOnly = false);
         /*! Destructor.
           * Terminates the NAO connection and unsubscribes from the video stream.
           */
@@ -4,6 +4,7 @@
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/video/video.hpp"
 #include <iostream>
+#include <ostream>
 
 using namespace cv;
 
@@ -37,6 +38,33 @@ class GaussianMixtureModel{
     /*! Temporary variable used to store datapoint - component correspondence */
     Mat componentProbability;
 
+    /*! Running sufficient statistics of stepwiseUpdate, six values per component, per unit of sample weight */
+    std::vector<double> onlineStatistics;
+
+    /*! EM algorithm specialized for two-dimensional models, used by runExpectationMaximization when dimensions equals 2.
+      * Components are initialized with weighted k-means++ seeding using a fixed random seed, so the same samples always
+      * produce the same model.
+      * Samples are unpacked into plain single precision arrays and fitted with fitSamples2D. Arguments are the same as for
+      * runExpectationMaximization.
+      */
+    bool runExpectationMaximization2D(const Mat samples, int maxIterations, double minStepIncrease);
+
+    /*! Two-dimensional EM over samples given as separate arrays of coordinates and weights. Every component's inverse
+      * covariance matrix and normalizer are computed once per iteration, so the per-sample loops do no matrix operations
+      * or allocations. Samples are single precision, as the histograms they come from; component parameters and the
+      * sums accumulated over the samples are kept in double precision. Returns false without changing the model if there
+      * are no samples or their total weight is not positive.
+      */
+    bool fitSamples2D(const std::vector<float>& xs, const std::vector<float>& ys, const std::vector<float>& ws,
+                      int maxIterations, double minStepIncrease);
+
+    /*! Lookup table construction specialized for two-dimensional models, used by makeLookup. Every component's
+      * exponent is a quadratic form whose column-dependent terms are tabulated once, so a whole row of bins is evaluated
+      * with multiply-adds and a single vectorized exp per component, and written directly into a CV_32F table.
+      * Arguments are the same as for makeLookup.
+      */
+    void makeLookup2D(int histSize[2], float c1range[2], float c2range[2]);
+
     /*! Returns the value of a gaussian probability density function defined by its covariance matrix and mean vector.
       * \param x N-dimensional point
       * \param covarianceMatrix Covariance matrix of the gaussian probability density function
@@ -55,6 +83,22 @@ public:
     /*! Lookup table constructed with makeLookup */
     Mat lookup;
 
+    /*! Number of worker threads the two-dimensional EM algorithm splits the samples across, 1 by default.
+      * Every thread accumulates partial sums over a contiguous block of samples and the sums are reduced in block order,
+      * so results are reproducible for a fixed number of threads.
+      */
+    int threads;
+
+    /*! Number of EM iterations used by the last two-dimensional fit */
+    int fitIterations;
+
+    /*! Weighted log likelihood of the histogram samples under the model returned by the last two-dimensional fit */
+    double fitLogLikelihood;
+
+    /*! Bayesian information criterion of the last two-dimensional fit, lower is better. Sample weights are rescaled to sum to
+      * the number of histogram samples before it is computed. */
+    double fitBIC;
+
     /*! True if model has been constructed, false otherwise */
     bool initialized;
 
@@ -65,8 +109,9 @@ public:
       * Defines dimensionality and number of components of resulting gaussian mixture model.
       * \param dims Model dimensionality
       * \param K Number of components
+      * \param numThreads Number of EM worker threads, see threads
       */
-    GaussianMixtureModel(int dims, int K);
+    GaussianMixtureModel(int dims, int K, int numThreads = 1);
 
     /*! Copy constructor */
     GaussianMixtureModel(const GaussianMixtureModel& other);
@@ -91,7 +136,7 @@ public:
     /*! Makes a lookup table in histogram format for easier and faster access.
       * Only works for two-dimensional gaussian mixture models. The created uniform histogram is defined by the number of bins in
       * each dimension and the range of values in each dimension. The function stores the histogram in the object's lookup attribute
-      * after normalizing it so that the max value equals 1
+      * after normalizing it so that the max value equals 1. The lookup table is of type CV_32F.
       *
       * \param histSize Number of bins in each dimension.
       * \param c1range Range of histogram values for the first dimension
@@ -100,9 +145,9 @@ public:
     void makeLookup(int histSize[2], float c1range[2], float c2range[2]);
 
     /*! Given a two-dimensional histogram, generate a GMM that best describes it.
-      * The function calls makeLookup after the GMM has been generated.
+      * The function calls makeLookup after the GMM has been generated. An empty histogram leaves the model unchanged.
       *
-      * \param histogram A 2-dimensional histogram
+      * \param histogram A 2-dimensional histogram of type CV_32F or CV_64F
       * \param histSize Number of bins in each dimension.
       * \param c1range Range of histogram values for the first dimension
       * \param c2range Range of histogram values for the second dimension
@@ -111,6 +156,48 @@ public:
       */
     void fromHistogram(const Mat histogram, int histSize[2], float c1range[2], float c2range[2], int maxIter, double minStepIncrease);
 
+    /*! Stepwise (online) EM update of a two-dimensional model from a new histogram, warm-started from the current components.
+      * Runs a single E-step over the histogram, blends the resulting sufficient statistics into running statistics with
+      * weight stepSize, re-estimates the components from them and rebuilds the lookup table. Returns false without changing
+      * the model if it is not initialized or not two-dimensional, or if the histogram is empty.
+      *
+      * \param histogram A 2-dimensional histogram
+      * \param histSize Number of bins in each dimension.
+      * \param c1range Range of histogram values for the first dimension
+      * \param c2range Range of histogram values for the second dimension
+      * \param stepSize Weight of the new histogram's statistics, between 0 and 1
+      */
+    bool stepwiseUpdate(const Mat histogram, int histSize[2], float c1range[2], float c2range[2], double stepSize);
+
+    /*! Same as fromHistogram, but only fits the model without making the lookup table. The non-empty bins are fitted
+      * directly with fitSamples2D, so the model has to be two-dimensional. The model is only marked as initialized if it was
+      * fitted; returns false and leaves it unchanged if the histogram is empty.
+      */
+    bool fitHistogram(const Mat histogram, int histSize[2], float c1range[2], float c2range[2], int maxIter, double minStepIncrease);
+
+    /*! Returns the number of components, K */
+    int numComponents() const;
+
+    /*! Returns the model dimensionality, N */
+    int numDimensions() const;
+
+    /*! Writes the model weights, means and covariance matrices to a binary stream.
+      * An uninitialized model is written as a model with no components. The lookup table is not stored.
+      *
+      * \param out Binary output stream
+      */
+    void writeBinary(std::ostream& out) const;
+
+    /*! Reads a model written by writeBinary from a memory buffer.
+      * On success, data is advanced past the model and the model is marked as initialized if it has any components.
+      * On failure, the model is left unchanged. Models with more than 16 dimensions or 256 components are rejected, so a
+      * corrupt file cannot request an arbitrarily large model.
+      *
+      * \param data Pointer to the start of the stored model, advanced past it on success
+      * \param end Pointer to the end of the memory buffer
+      */
+    bool readBinary(const char*& data, const char* end);
+
 };
 
 /*! A class used for simplifying histogram backpropagation, with support for gaussian mixture model construction.
@@ -124,6 +211,16 @@ protected:
     /*! Integer matrix used to store the raw number of pixels*/
     Mat accumulator;
 
+    /*! Raw number of pixels of the occupied bins, used instead of accumulator by fromImage and update when the histogram
+      * has at least sparseMinBins bins*/
+    SparseMat sparseAccumulator;
+
+    /*! Returns true if the pixel counts are held in sparseAccumulator*/
+    bool sparse() const;
+
+    /*! Returns the pixel counts as a dense matrix, converting sparseAccumulator if it is in use*/
+    Mat counts() const;
+
     /*! Number of histogram bins in each dimension*/
     int histSize[2];
 
@@ -138,13 +235,49 @@ protected:
 
     /*! Gaussian mixture model object*/
     GaussianMixtureModel gmm;
+
+    /*! Writes a versioned binary model consisting of the histogram geometry, a CV_32F histogram and the gaussian mixture model.
+      * Values are written in native byte order and read back bit-exact by readBinary.
+      *
+      * \param out Binary output stream
+      * \param histogram Histogram of this object's size to store, usually normalized
+      */
+    void writeBinary(std::ostream& out, const Mat histogram) const;
+
+    /*! Reads a binary model written by writeBinary from a memory buffer, such as a memory mapped file.
+      * Fails if the buffer is not a model of a supported version, if its geometry differs from this histogram's or if
+      * the stored gaussian mixture model is not two-dimensional.
+      * On success, the stored gaussian mixture model replaces gmm and data is advanced past the model.
+      *
+      * \param data Pointer to the start of the stored model, advanced past it on success
+      * \param end Pointer to the end of the memory buffer
+      * \param histogram Output matrix to store the CV_32F histogram into
+      */
+    bool readBinary(const char*& data, const char* end, Mat& histogram);
+
+    /*! Marks the gaussian mixture model as ready and stores its normalized lookup table as the histogram*/
+    void useGMMLookup();
+
+    /*! Number of times the histogram has changed, incremented by quantize()*/
+    unsigned int changes;
 public:
     /*! Boolean flag used to check if GMM is initialized*/
     bool gmmReady;
 
+    /*! Default value of sparseMinBins, 128x128 bins*/
+    static const int defaultSparseMinBins = 16384;
+
+    /*! Number of bins from which fromImage and update keep the pixel counts in a sparse accumulator. Object colors
+      * occupy few bins of fine histograms, so decaying and adding pixels then only touches the occupied bins.
+      * The normalized histogram stays dense, since backpropagation looks every pixel's bin up in it.*/
+    int sparseMinBins;
+
     /*! The actual histogram, normalized so that the maximum value equals 1*/
     Mat normalized;
 
+    /*! The normalized histogram quantized to CV_8U, so that the maximum value equals 255. Kept in sync with normalized by quantize()*/
+    Mat quantized;
+
     /*! Default constructor*/
     Histogram();
 
@@ -175,7 +308,8 @@ public:
 
     /*! Updates an existing histogram.
       * Given a masked image and a learning coefficient alpha, decay the pixel accumulator by *=(1-alpha), add the masked
-      * pixels to the accumulator, then construct a new histogram from the accumulated pixels.
+      * pixels to the accumulator, then construct a new histogram from the accumulated pixels. Bins of a sparse
+      * accumulator whose count decays below 1e-4 pixels are dropped.
       *
       * \param image Input image already converted to the desired color space
       * \param alpha Learning coefficient
@@ -190,13 +324,117 @@ public:
       */
     void backPropagate(Mat inputImage, Mat* outputImage);
 
+    /*! Runs histogram backpropagation for several histograms in a single pass over the input image.
+      * All histograms must share the same channels, histogram size and ranges. Each pixel is binned only once and the
+      * resulting bin index is used to look up every histogram, so the cost of binning does not grow with the number
+      * of histograms. Output images are of type CV_32F, one per histogram, in the order the histograms were given.
+      *
+      * \param inputImage Input image already converted to the desired color space, of depth CV_8U or CV_32F
+      * \param histograms Histograms to backpropagate
+      * \param outputImages Vector to store the output probability images into
+      */
+    static void backPropagate(const Mat inputImage, const std::vector<const Histogram*>& histograms, std::vector<Mat>& outputImages);
+
+    /*! Backpropagates several histograms using a precomputed bin index image, see binIndices.
+      * All histograms must share the geometry the bin index image was created with.
+      *
+      * \param binImage Bin index image of type CV_16U
+      * \param histograms Histograms to backpropagate
+      * \param outputImages Vector to store the output CV_32F probability images into
+      */
+    static void backPropagateBins(const Mat binImage, const std::vector<const Histogram*>& histograms, std::vector<Mat>& outputImages);
+
+    /*! Backpropagates several histograms using a precomputed bin index image and their quantized 8-bit lookup tables.
+      * Produces CV_8U probability images in the range 0-255, which take a quarter of the memory bandwidth of the
+      * CV_32F images produced by backPropagateBins.
+      *
+      * \param binImage Bin index image of type CV_16U
+      * \param histograms Histograms to backpropagate
+      * \param outputImages Vector to store the output CV_8U probability images into
+      */
+    static void backPropagateQuantized(const Mat binImage, const std::vector<const Histogram*>& histograms, std::vector<Mat>& outputImages);
+
+    /*! Updates the quantized 8-bit copy of the normalized histogram. Call after modifying normalized directly.*/
+    void quantize();
+
+    /*! Returns a counter which changes whenever the histogram does. Tables derived from the histogram can store it and
+      * rebuild themselves when it no longer matches.
+      */
+    unsigned int revision() const;
+
+    /*! Quantizes an image into a single-channel CV_16U image of flattened histogram bin indices.
+      * The bin of a pixel is bin1*histSize[1]+bin2, computed exactly as calcHist and calcBackProject would for a uniform
+      * histogram. Pixels outside the histogram ranges are set to histSize[0]*histSize[1]. The resulting image can be
+      * shared by all histograms of the same geometry, so the image only has to be quantized once.
+      *
+      * \param image Input image already converted to the desired color space, of depth CV_8U or CV_32F
+      * \param channels Array of image channels to construct the histogram from
+      * \param histSize Number of histogram bins in each dimension
+      * \param c1range Range of histogram values for the first dimension
+      * \param c2range Range of histogram values for the second dimension
+      * \param binImage Output bin index image. The geometry must have fewer than 65536 bins, see BinIndexer::fits.
+      */
+    static void binIndices(const Mat image, const int channels[2], const int histSize[2], const float c1range[2], const float c2range[2], Mat& binImage);
+
+    /*! Quantizes an image into a bin index image using this histogram's geometry.
+      *
+      * \param image Input image already converted to the desired color space
+      * \param binImage Output bin index image
+      */
+    void binIndices(const Mat image, Mat& binImage) const;
+
+    /*! Counts the pixels of a bin index image into a CV_32F histogram of this histogram's size.
+      * Equivalent to calling calcHist on the image the bin index image was created from.
+      *
+      * \param binImage Bin index image of type CV_16U
+      * \param mask Matrix of type CV_8U which defines the pixels to count, or an empty matrix to count all pixels
+      * \param histogram Output histogram
+      */
+    void calcFromBins(const Mat binImage, const Mat mask, Mat& histogram) const;
+
+    /*! Counts the pixels of a bin index image into a CV_32F histogram of the given size.
+      *
+      * \param binImage Bin index image of type CV_16U
+      * \param mask Matrix of type CV_8U which defines the pixels to count, or an empty matrix to count all pixels
+      * \param histSize Number of histogram bins in each dimension the bin index image was created with
+      * \param histogram Output histogram
+      */
+    static void calcFromBins(const Mat binImage, const Mat mask, const int histSize[2], Mat& histogram);
+
     /*! Makes a gaussian mixture model from the existing histogram and stores a normalized lookup table as the new histogram.
+      * If the histogram is empty no model is made, gmmReady is cleared and the histogram is left as it is.
       *
       * \param K Number of components for the gaussian mixture model
       * \param maxIter Maximum number of iterations after which the EM algorithm terminates
       * \param minStepIncrease Percentage increase of log likelihood below which the local optimum is presumed to have been achieved
+      * \param threads Number of threads the EM algorithm runs on
       */
-    void makeGMM(int K, int maxIter, double minStepIncrease);
+    void makeGMM(int K, int maxIter, double minStepIncrease, int threads = 1);
+
+    /*! Makes gaussian mixture models with 1 to maxK components from the existing histogram, fitting them concurrently, and
+      * keeps the one with the fewest components whose BIC is within bicTolerance of the best one. The lookup table of the
+      * kept model is stored as the new histogram, as in makeGMM. Returns false and leaves the model unchanged if the
+      * histogram is empty.
+      *
+      * \param maxK Largest number of components to try, values below 1 are treated as 1
+      * \param maxIter Maximum number of iterations after which the EM algorithm terminates
+      * \param minStepIncrease Percentage increase of log likelihood below which the local optimum is presumed to have been achieved
+      * \param bicTolerance BIC difference to the best model below which a model with fewer components is preferred
+      * \param threads Total number of threads used for fitting, shared between the candidates fitted at the same time
+      */
+    bool selectGMM(int maxK, int maxIter, double minStepIncrease, double bicTolerance, int threads = 1);
+
+    /*! Updates the gaussian mixture model from a new histogram with GaussianMixtureModel::stepwiseUpdate and stores the
+      * updated lookup table in the output matrix. Returns false if there is no model to update.
+      *
+      * \param histogram Histogram of this object's size to update the model with
+      * \param stepSize Weight of the new histogram, between 0 and 1
+      * \param smoothed Output CV_32F lookup table of the updated model, normalized to 0-1
+      */
+    bool updateGMM(const Mat histogram, double stepSize, Mat& smoothed);
+
+    /*! Returns the gaussian mixture model made by makeGMM, including its fit telemetry.*/
+    const GaussianMixtureModel& model() const;
 
     /*! Sets the stored histogram size to the new specified values.
       *
@@ -206,6 +444,73 @@ public:
 };
 
 
+/*! \brief Computes bin index images for a fixed histogram geometry.
+  *
+  * Instances are created with create(), which returns a kernel compiled for the given channels and bin counts when the
+  * histogram has 32, 64 or 128 bins per dimension over the 0-256 range of both channels, where binning reduces to shifts.
+  * Any other geometry gets a generic kernel which uses Histogram::binIndices. Both produce identical bin index images.
+  */
+class BinIndexer{
+public:
+    virtual ~BinIndexer() {};
+
+    /*! Computes the bin index image of an image, see Histogram::binIndices.
+      *
+      * \param image Input image of type CV_8U or CV_32F already converted to the desired color space
+      * \param binImage Output bin index image of type CV_16U
+      */
+    virtual void binIndices(const Mat image, Mat& binImage) const = 0;
+
+    /*! Returns true if the indexer is specialized for its geometry rather than generic.*/
+    virtual bool specialized() const = 0;
+
+    /*! Returns true if a geometry's bin indices and the out of range index fit a CV_16U bin image, that is if it has
+      * fewer than 65536 bins in total.
+      */
+    static bool fits(const int histSize[2]);
+
+    /*! Creates the fastest available indexer for a histogram geometry. Arguments are the same as for the Histogram constructor.
+      * Returns an empty pointer for geometries which do not fit a CV_16U bin image, see fits. Such histograms can still be
+      * backpropagated with Histogram::backPropagate.
+      */
+    static Ptr<BinIndexer> create(const int channels[2], const int histSize[2], const float c1range[2], const float c2range[2]);
+};
+
+/*! \brief Blurs, converts and quantizes a BGR image to Cr/Cb bin indices in a single pass.
+  *
+  * Gives the same bin indices as blur with a 5x5 kernel, cvtColor with CV_BGR2YCrCb and a BinIndexer over the Cr and Cb
+  * channels with the 0-256 range, but streams the image row by row without writing the blurred and converted images.
+  *
+  * \param image Input image of type CV_8UC3 in BGR order, at least 3x3 pixels
+  * \param bins Number of bins per channel, 32, 64 or 128
+  * \param binImage Output bin index image of type CV_16U with Cr as the first histogram dimension
+  * \return False if the image type or bin count is not supported, in which case binImage is not written
+  */
+bool blurYCrCbBins(const Mat image, int bins, Mat& binImage);
+
+/*! \brief Extracts the chroma of a YUV422 image as a two-channel Cr/Cb image of the same size.
+  *
+  * Every pair of pixels in a YUV422 image shares one U and one V sample, which is repeated for both pixels without
+  * interpolation or color conversion, so positions and distances in the chroma image are the same as in the camera
+  * image. U and V are the Cb and Cr channels of YCrCb.
+  *
+  * YUV422 video, such as the NAO camera's, normally uses the BT.601 studio range with chroma between 16 and 240, while
+  * histograms trained on BGR images use the 0-255 range of cvtColor. With limitedRange set the chroma is stretched to
+  * that range; it should only be cleared for sources known to deliver full range chroma.
+  *
+  * \param yuv422 Input image of type CV_8UC2 with bytes interleaved as Y0 U Y1 V, such as the NAO camera's native format
+  * \param chroma Output image of type CV_8UC2, with Cr (V) as the first and Cb (U) as the second channel
+  * \param limitedRange True if the input chroma is in the 16-240 range and should be stretched to 0-255
+  */
+void yuv422Chroma(const Mat yuv422, Mat& chroma, bool limitedRange = true);
+
+/*! \brief Converts a two-channel Cr/Cb image to BGR at a fixed mid-gray luma, for display.
+  *
+  * \param chroma Input image of type CV_8UC2 with Cr as the first and Cb as the second channel
+  * \param bgr Output image of type CV_8UC3
+  */
+void chromaToBGR(const Mat chroma, Mat& bgr);
+
 /*! An abstract class used as the base class for all image processing pipeline components.
  */
 class ProcessingElement{
@@ -215,6 +520,25 @@ public:
     virtual void process(const Mat inputImage, Mat* outputImage) = 0;
 };
 
+/*! Smoothing applied to the input image before the colorspace conversion in ColorHistBackProject.
+  */
+enum PreprocessMode{
+    PREPROCESS_NONE, /*!< No smoothing*/
+    PREPROCESS_BOX, /*!< 5x5 box blur*/
+    PREPROCESS_GAUSSIAN, /*!< Separable 5x5 gaussian blur*/
+    PREPROCESS_BILATERAL_DOWNSAMPLED, /*!< Bilateral filter on a half resolution image, upsampled back to full resolution*/
+    PREPROCESS_GUIDED, /*!< Self-guided filter with radius 2, built from box filters*/
+    PREPROCESS_BILATERAL /*!< Full resolution 5 pixel bilateral filter, the default*/
+};
+
+/*! Parses a preprocessing mode name, one of none, box, gaussian, bilateral-downsampled, guided or bilateral.
+  *
+  * \param name Mode name
+  * \param mode Output mode, left unchanged if the name is unknown
+  * \return False if the name is unknown
+  */
+bool parsePreprocessMode(const std::string name, PreprocessMode& mode);
+
 /*! 2D histogram-based image flattening class. Supports HSV, HLS and YUV colorspaces.
   */
 class ColorHistBackProject : public ProcessingElement{
@@ -222,9 +546,12 @@ protected:
     Mat histogramMask;
     int colorspaceCode;
     Histogram objHistogram;
+    Ptr<BinIndexer> binIndexer;
     void preprocess(const Mat image, Mat* outputImage);
 public:
     //bool initialized;
+    /*! Smoothing applied by preprocess, PREPROCESS_BILATERAL by default*/
+    PreprocessMode preprocessMode;
     ColorHistBackProject();
     ColorHistBackProject(int code, const int* histogramSize);
     ColorHistBackProject(int code, const int* histogramSize, String filename);
@@ -242,8 +569,26 @@ public:
 };
 
 class GMMColorHistBackProject : public ColorHistBackProject{
+protected:
+    /*! Preprocessed input image and its bin indices, kept between frames to avoid reallocation*/
+    Mat cvtImage;
+    Mat binImage;
+    /*! Coarse color histogram of past input images, decayed exponentially with every new image*/
+    Histogram aprioriHistogram;
+    /*! Histogram holding the ratio of the object and apriori histograms, rebuilt every frame*/
+    Histogram ratioHistogram;
+    /*! True once the apriori histogram has been built from the first image*/
+    bool aprioriReady;
+    /*! Learning coefficient of the apriori histogram, see Histogram::update*/
+    double aprioriDecay;
 public:
     void histFromImage(const Mat image);
+
+    /*! Backpropagates the ratio of the object histogram and the decayed apriori histogram, median blurs it and rescales
+      * it to 0-1 over the pixels of the frame. The apriori probability now includes past frames, and the median blur
+      * is applied once to the ratio rather than to both backprojections before dividing, so the output differs slightly
+      * from dividing two median blurred backprojections of the current frame.
+      */
     void process(const Mat inputImage, Mat* outputImage);
     GMMColorHistBackProject();
     GMMColorHistBackProject(int code, const int* histogramSize);
@@ -16,6 +16,8 @@ class NAOEvent{
 public:
     std::string name;
     int objectId;
+    /* handle of the tracked kind when objectId refers to the largest object of a kind, -1 otherwise */
+    int kindHandle;
     Trajectory trajectory;
     NAOEvent(std::string tName, int tObjectId);
     NAOEvent(std::string tName, int tObjectId, std::vector<float> num, std::vector<float> den);
@@ -36,7 +38,7 @@ public:
     void startTracker(const int &milli, const int &camIdx);
     void stopTracker();
 
-    void loadDataset(const std::string& dataFolder);
+    int loadDataset(const std::string& dataFolder);
     AL::ALValue getObjectList(const int& dataCode);
     AL::ALValue getObjectData(const AL::ALValue &objectIds, const int& dataCode);
     bool trackObject(const std::string& name, const int& objId);
@@ -50,6 +52,7 @@ public:
     AL::ALValue getEventList();
     bool removeEvent(const std::string &name);
     void removeObjectKind(const int &id);
+    bool setTrackerOption(const std::string &name, const bool &value);
     void clearEventTraj(const std::string &name);
 private:
     struct Impl;
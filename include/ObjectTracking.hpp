@@ -15,18 +15,82 @@
 using namespace std;
 using namespace cv;
 
+/* Decides when an object kind's histogram should be adapted. An update is requested when the mean probability inside
+   the kind's blobs or their total area drifts by more than driftThreshold (relative) from the values at the last update,
+   or when maxInterval frames have passed since it. */
+class AdaptationScheduler{
+public:
+    double driftThreshold;
+    int maxInterval;
+    int framesSinceUpdate;
+    long long skippedUpdates;
+    long long performedUpdates;
+    double referenceProbability;
+    double referenceArea;
+    bool hasReference;
+    AdaptationScheduler();
+    AdaptationScheduler(double threshold, int interval);
+    bool shouldUpdate(double meanProbability, double area);
+};
+
 class UpdatableHistogram : public Histogram{
 protected:
     int buffersize;
     vector<Mat> buffer;
+    vector<bool> bufferValid;
+    Mat bufferSum;
+    int bufferHead;
+    int bufferCount;
+    int bufferPushes;
     Mat offline;
+    Mat colorTable;
+    unsigned int colorTableRevision;
+    void adapt(const Mat binImage, const Mat colorHist, double alpha, const Mat frameHistogram);
 public:
+    AdaptationScheduler scheduler;
+    /* when set, adapted histograms update the gaussian mixture model with one stepwise EM step of size gmmStepSize and
+       its lookup is blended with the offline histogram instead of the raw averaged histogram */
+    bool onlineGMM;
+    double gmmStepSize;
     UpdatableHistogram();
     UpdatableHistogram(int channels[2], int histogramSize[2], float channel1range[2], float channel2range[2], int bufferSize);
     void update(Mat image, double alpha, const Mat mask);
-    void fromImage(const vector<Mat> image, const vector<Mat> mask);
-    void toImage(std::string rootPath);
+    void updateFromBins(const Mat binImage, double alpha, const Mat mask, const Mat frameHistogram);
+    void updateFromBlobs(const Mat binImage, double alpha, const vector<vector<Point2i> >& blobs, const Mat frameHistogram);
+    /* threads is the total number of threads the color model selection may use */
+    void fromImage(const vector<Mat> image, const vector<Mat> mask, int threads = 1);
+    void toStored(std::string rootPath);
     bool fromStored(std::string rootPath);
+    /* maps every cell of a quantized color space straight to this kind's probability. colorBins holds the histogram bin
+       of each cell as CV_16U, the table is CV_8U when quantizedTable is set and CV_32F otherwise. It is rebuilt only when
+       the histogram has changed since the last call. */
+    const Mat& colorLookup(const Mat colorBins, bool quantizedTable);
+};
+
+/* Owns the object kind models of an ObjectTracker. Kinds are held through shared pointers, so adding or removing a kind
+   only moves pointers and never copies a model. Each kind gets a handle on insertion which, unlike its index, stays valid
+   when other kinds are removed. A slot can be reserved before its model exists, so a kind gets its index when it is
+   requested; such a pending kind has no model and is skipped by the tracker until its model is published. A kind whose
+   model fails to build stays pending, so the indices of the kinds after it do not change. */
+class ObjectKindRegistry{
+protected:
+    vector<boost::shared_ptr<UpdatableHistogram> > kinds;
+    vector<int> handles;
+    int nextHandle;
+public:
+    ObjectKindRegistry();
+    int add(boost::shared_ptr<UpdatableHistogram> kind);
+    int reserve();
+    bool publish(int handle, boost::shared_ptr<UpdatableHistogram> kind);
+    bool ready(int index) const;
+    bool remove(int index);
+    int indexOf(int handle) const;
+    int handleOf(int index) const;
+    boost::shared_ptr<UpdatableHistogram> get(int index) const;
+    UpdatableHistogram& operator[](int index);
+    const UpdatableHistogram& operator[](int index) const;
+    UpdatableHistogram& back();
+    size_t size() const;
 };
 
 class TrackedObject{
@@ -70,19 +134,53 @@ class ObjectTracker : public ProcessingElement{
     protected:
     int frameNumber;
     int nextObjectIdx;
+    int histChannels[2];
+    int histSize[2];
+    float c1range[2];
+    float c2range[2];
+    Ptr<BinIndexer> binIndexer;
+    Mat colorBins;
+    void lookupFrame(const Mat image, Mat& binImage, vector<Mat>& outputImages);
     public:
-    vector<UpdatableHistogram> objectKinds;
+    ObjectKindRegistry objectKinds;
     objMap objects;
     //vector<boost::shared_ptr<TrackedObject> > objects;
     vector<RotatedRect> lastFrameBlobs;
     vector<int> largestObjOfKind;
+    bool quantizedProbability;
+    int histBufferSize;
+    bool onlineGMM;
+    /* when set, frames are blurred and each pixel's BGR color is quantized to colorLookupBits per channel and looked up
+       directly in per-kind probability tables, skipping the color conversion and backprojection of preprocess and
+       getProbImages */
+    bool colorLookup;
+    static const int colorLookupBits = 5;
+    /* number of threads that fit the color model of a new kind, 0 uses all cores but one so tracking keeps a core */
+    int modelThreads;
 	ObjectTracker();
-    void preprocess(const Mat image, Mat& outputImage, Mat& mask);
-    void getProbImages(const Mat procimg, const Mat mask, vector<Mat>& outputImages);
+    /* frames are either BGR images or two-channel Cr/Cb images, such as the chroma of YUV422 frames from yuv422Chroma */
+    void preprocess(const Mat image, Mat& outputImage, Mat& binImage);
+    void binFrame(const Mat image, Mat& binImage);
+    void getProbImages(const Mat binImage, vector<Mat>& outputImages);
+    /* bins a frame and computes the probability image of every kind the way process does, CV_8U when
+       quantizedProbability is set and CV_32F otherwise */
+    void probabilityImages(const Mat image, Mat& binImage, vector<Mat>& outputImages);
 	void process(const Mat inputImage, Mat* outputImage);
+    /* buildObjectKind and loadObjectKind only read the histogram geometry, which is fixed at construction, so they can
+       run on another thread while the tracker is processing frames. The resulting kind is published with
+       adoptObjectKind, which only appends a pointer, or into a slot taken earlier with reserveObjectKind, which only
+       swaps one in. adoptObjectKind and publishObjectKind copy the tracker's onlineGMM setting into the kind, so they
+       must be called from the thread that owns the tracker or under its lock. publishObjectKind returns false if the
+       reserved kind was removed in the meantime. */
+    boost::shared_ptr<UpdatableHistogram> buildObjectKind(const vector<Mat> image, const vector<Mat> outMask);
+    boost::shared_ptr<UpdatableHistogram> loadObjectKind(std::string path);
+    void adoptObjectKind(boost::shared_ptr<UpdatableHistogram> kind);
+    int reserveObjectKind();
+    bool publishObjectKind(int handle, boost::shared_ptr<UpdatableHistogram> kind);
     bool addObjectKind(const vector<Mat> image, const vector<Mat> outMask);
     bool addObjectKind(const vector<Mat> image, const vector<Mat> outMask, std::string path);
     bool addObjectKind(std::string path);
+    bool removeObjectKind(int index);
 };
 
 bool intersectingOBB(RotatedRect obb1, RotatedRect obb2);
@@ -95,6 +193,8 @@ double distRotatedRect(RotatedRect r1, RotatedRect r2);
 
 void occludeBy(boost::shared_ptr<TrackedObject> underObject, boost::shared_ptr<TrackedObject> overObject);
 
+/* inputImg is either a CV_32F probability image in the range 0-1 or a CV_8U one in the range 0-255. Thresholds are
+   always given in the range 0-1 and are rescaled for 8-bit images. */
 void hysteresisThreshold(const cv::Mat inputImg, cv::Mat& binary, std::vector < std::vector<cv::Point2i> > &blobs, double lowThresh, double hiThresh);
 
 
@@ -64,6 +64,10 @@ void DisplayWindow::operator ()()
             imLock.lock();
             process(dispImg, endImage, mode);
             imLock.unlock();
+            //two-channel Cr/Cb frames from YUV422 cameras have no luma, so they are shown at a fixed gray level
+            if (endImage.type()==CV_8UC2){
+                chromaToBGR(endImage, endImage);
+            }
             if (dragging && mode==0){
                 rectangle(endImage, dragStartL, currentPos, Scalar(0,0,255));
             }
@@ -152,9 +156,15 @@ void DisplayWindow:: onDragStop(){
             int width=abs(dragStartL.x-currentPos.x);
             int height=abs(dragStartL.y-currentPos.y);
             Rect imageROI = Rect(x,y,width,height);
-            imLock.lock();
+            boost::mutex::scoped_lock lock(imLock);
             Mat subimage(dispImg, imageROI);
+            //two-channel Cr/Cb frames from YUV422 cameras can only train the object tracker, the backprojection
+            //elements convert from BGR
+            bool chromaOnly = dispImg.type()==CV_8UC2;
             for (int i=0; i<processingElements.size(); i++){
+                if (chromaOnly && processingElements[i]->name.compare("ObjectTracker")!=0){
+                    continue;
+                }
                 if (processingElements[i]->name.compare("ColorHistBackProject")==0){
                     ColorHistBackProject *temp = static_cast<ColorHistBackProject*>(processingElements[i]);
                     temp->histFromImage(subimage);
@@ -179,7 +189,6 @@ void DisplayWindow:: onDragStop(){
                     temp->addObjectKind(imvec, maskvec);
                 }
             }
-            imLock.unlock();
         } catch(Exception e){
             std::cout << e.msg << std::endl;
         }
@@ -239,7 +248,15 @@ void DisplayWindow::onKeyPress(int key){
 
             std::string spath = full_path.c_str();
             imLock.lock();
-            imwrite(spath, dispImg, compression_params);
+            //JPEG cannot hold two-channel Cr/Cb frames, so they are saved the way they are displayed
+            if (dispImg.type()==CV_8UC2){
+                Mat saved;
+                chromaToBGR(dispImg, saved);
+                imwrite(spath, saved, compression_params);
+            }
+            else {
+                imwrite(spath, dispImg, compression_params);
+            }
             imLock.unlock();
         }
         if (key>47 && key<58){
@@ -1,4 +1,5 @@
 #include "ImageAcquisition.h"
+#include "ImgProcPipeline.hpp"
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 #include <string>
@@ -34,8 +35,8 @@ bool ConnectedCamera::getImage(cv::Mat &outputImage){
 }
 
 
-NAOCamera::NAOCamera(const std::string IP, int port) : camproxy(IP, port){
-    clientName = camproxy.subscribeCamera("ObjectGestureRemote", 0, kQVGA, kBGRColorSpace, 20);
+NAOCamera::NAOCamera(const std::string IP, int port, bool chromaOnly) : camproxy(IP, port), yuv422(chromaOnly){
+    clientName = camproxy.subscribeCamera("ObjectGestureRemote", 0, kQVGA, yuv422 ? kYUV422ColorSpace : kBGRColorSpace, 20);
     /*camproxy.setParam(3, 40);
     camproxy.setParam(11, 1);
     camproxy.setParam(22, 2);
@@ -52,9 +53,15 @@ NAOCamera::~NAOCamera(){
 bool NAOCamera::getImage(cv::Mat &outputImage){
     try{
         ALValue img = camproxy.getImageRemote(clientName);
-        Mat imgHeader = Mat(Size(320, 240), CV_8UC3,  (void*)img[6].GetBinary());
-        //imgHeader.data = (uchar*) img[6].GetBinary();
-        imgHeader.copyTo(outputImage);
+        if (yuv422){
+            Mat imgHeader = Mat(Size(320, 240), CV_8UC2,  (void*)img[6].GetBinary());
+            yuv422Chroma(imgHeader, outputImage);
+        }
+        else {
+            Mat imgHeader = Mat(Size(320, 240), CV_8UC3,  (void*)img[6].GetBinary());
+            //imgHeader.data = (uchar*) img[6].GetBinary();
+            imgHeader.copyTo(outputImage);
+        }
         camproxy.releaseImage(clientName);
 
     }
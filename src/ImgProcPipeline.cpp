@@ -2,12 +2,39 @@
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/video/video.hpp"
 #include "ImgProcPipeline.hpp"
+#include "boost/thread.hpp"
+#include "boost/bind.hpp"
 #include <iostream>
 #include <cmath>
+#include <cstring>
 
 using namespace cv;
 
-Histogram::Histogram(){};
+/* binary model files start with this tag, followed by the format version*/
+static const char modelMagic[4] = {'N','O','G','M'};
+static const int modelVersion = 1;
+//decayed pixel count below which a bin is dropped from a sparse accumulator
+static const float sparsePruneCount = 1e-4f;
+//upper bounds on the gaussian mixture model read from a stored model
+static const int maxStoredDimensions = 16;
+static const int maxStoredComponents = 256;
+
+template<typename T>
+static void writeValue(std::ostream& out, const T& value){
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+static bool readValue(const char*& data, const char* end, T& value){
+    if (end-data < (ptrdiff_t)sizeof(T)){
+        return false;
+    }
+    memcpy(&value, data, sizeof(T));
+    data += sizeof(T);
+    return true;
+}
+
+Histogram::Histogram(): sparseMinBins(defaultSparseMinBins), changes(0){};
 
 Histogram::Histogram(int inchannels[2], int histogramSize[2], float channel1range[2], float channel2range[2]){
     channels[0] = inchannels[0];
@@ -19,6 +46,8 @@ Histogram::Histogram(int inchannels[2], int histogramSize[2], float channel1rang
     c2range[0] = channel2range[0];
     c2range[1] = channel2range[1];
     gmmReady = false;
+    sparseMinBins = defaultSparseMinBins;
+    changes = 0;
 }
 
 Histogram::Histogram(const Histogram& other){
@@ -31,9 +60,13 @@ Histogram::Histogram(const Histogram& other){
     c2range[0] = other.c2range[0];
     c2range[1] = other.c2range[1];
     other.accumulator.copyTo(accumulator);
+    other.sparseAccumulator.copyTo(sparseAccumulator);
     other.normalized.copyTo(normalized);
+    other.quantized.copyTo(quantized);
     gmmReady = other.gmmReady;
     gmm = other.gmm;
+    sparseMinBins = other.sparseMinBins;
+    changes = other.changes;
 }
 
 Histogram& Histogram::operator=(const Histogram& other){
@@ -47,34 +80,115 @@ Histogram& Histogram::operator=(const Histogram& other){
         c2range[0] = other.c2range[0];
         c2range[1] = other.c2range[1];
         other.accumulator.copyTo(accumulator);
+        other.sparseAccumulator.copyTo(sparseAccumulator);
         other.normalized.copyTo(normalized);
+        other.quantized.copyTo(quantized);
         gmmReady = other.gmmReady;
         gmm = other.gmm;
+        sparseMinBins = other.sparseMinBins;
+        changes = other.changes;
     }
     return *this;
 }
 
+/* normalizes sparse pixel counts the same way as a dense accumulator, bins without a node count as zero pixels*/
+static void normalizeSparse(const SparseMat& counts, const int histSize[2], Mat& normalized){
+    float histMax = 0;
+    float histMin = 0;
+    bool first = true;
+    for (SparseMatConstIterator it = counts.begin(); it!=counts.end(); ++it){
+        float value = it.value<float>();
+        if (first || value>histMax) {histMax = value;}
+        if (first || value<histMin) {histMin = value;}
+        first = false;
+    }
+    if ((int)counts.nzcount()<histSize[0]*histSize[1]){
+        histMin = 0;
+    }
+    float scale = histMax>histMin ? 1/(histMax-histMin) : 0;
+    normalized.create(histSize[0], histSize[1], CV_32F);
+    normalized.setTo(Scalar(0));
+    for (SparseMatConstIterator it = counts.begin(); it!=counts.end(); ++it){
+        const SparseMat::Node* node = it.node();
+        normalized.at<float>(node->idx[0], node->idx[1]) = (it.value<float>()-histMin)*scale;
+    }
+}
+
+bool Histogram::sparse() const{
+    return accumulator.empty() && sparseAccumulator.dims()>0;
+}
+
+Mat Histogram::counts() const{
+    if (!sparse()){
+        return accumulator;
+    }
+    Mat dense;
+    sparseAccumulator.convertTo(dense, CV_32F);
+    return dense;
+}
+
 void Histogram::fromImage(Mat image, const Mat mask = Mat()){
     const float* ranges[] = {c1range, c2range};
+    if (histSize[0]*histSize[1]>=sparseMinBins){
+        calcHist(&image, 1, channels, mask, sparseAccumulator, 2, histSize, ranges, true, false);
+        accumulator.release();
+        normalizeSparse(sparseAccumulator, histSize, normalized);
+        quantize();
+        return;
+    }
+    sparseAccumulator = SparseMat();
     calcHist(&image, 1, channels, mask, accumulator, 2, histSize, ranges, true, false);
 
     double histMax = 0;
     double histMin = 0;
     minMaxLoc(accumulator, &histMin, &histMax, NULL, NULL);
     accumulator.convertTo(normalized,CV_32F,1/(histMax-histMin),-histMin/(histMax-histMin));
+    quantize();
 }
 
 void Histogram::update(Mat image, double alpha, const Mat mask = Mat()){
     const float* ranges[] = {c1range, c2range};
+    if (sparse()){
+        //decays only the occupied bins and drops the ones that no longer hold a meaningful count
+        std::vector<const SparseMat::Node*> faded;
+        for (SparseMatIterator it = sparseAccumulator.begin(); it!=sparseAccumulator.end(); ++it){
+            float& value = it.value<float>();
+            value *= (float)(1-alpha);
+            if (value<sparsePruneCount){
+                faded.push_back(it.node());
+            }
+        }
+        for (size_t i=0; i<faded.size(); i++){
+            size_t hashval = faded[i]->hashval;
+            sparseAccumulator.erase(faded[i]->idx[0], faded[i]->idx[1], &hashval);
+        }
+        //calcHist rounds the stored counts when accumulating, so the new pixels are counted separately and added
+        SparseMat temp;
+        calcHist(&image, 1, channels, mask, temp, 2, histSize, ranges, true, false);
+        for (SparseMatConstIterator it = temp.begin(); it!=temp.end(); ++it){
+            const SparseMat::Node* node = it.node();
+            size_t hashval = node->hashval;
+            sparseAccumulator.ref<float>(node->idx[0], node->idx[1], &hashval) += it.value<float>();
+        }
+        normalizeSparse(sparseAccumulator, histSize, normalized);
+        quantize();
+        return;
+    }
+    if (accumulator.empty()){
+        fromImage(image, mask);
+        return;
+    }
     Mat temp;
     accumulator *= (1-alpha);
-    calcHist(&image, 1, channels, mask, temp, 2, histSize, ranges, true, true);
+    calcHist(&image, 1, channels, mask, temp, 2, histSize, ranges, true, false);
+    accumulator += temp;
 
 
     double histMax = 0;
     double histMin = 0;
     minMaxLoc(accumulator, &histMin, &histMax, NULL, NULL);
     accumulator.convertTo(normalized,CV_32F,1/(histMax-histMin),-histMin/(histMax-histMin));
+    quantize();
 }
 
 void Histogram::backPropagate(Mat inputImage, Mat* outputImage){
@@ -83,17 +197,578 @@ void Histogram::backPropagate(Mat inputImage, Mat* outputImage){
     outputImage->convertTo(*outputImage, CV_32FC1);
 }
 
-void Histogram::makeGMM(int K, int maxIter = 10, double minStepIncrease = 0.01){
-    gmm = GaussianMixtureModel(2,K);
-    accumulator.convertTo(normalized, CV_64F);
-    gmm.fromHistogram(normalized, histSize, c1range, c2range, maxIter, minStepIncrease);
+/* coefficients mapping a channel value v to its bin index floor(v*scale+shift) for uniform histograms*/
+static void binScaleShift(const int histSize[2], const float c1range[2], const float c2range[2], double scale[2], double shift[2]){
+    scale[0] = histSize[0]/(1.0*(c1range[1]-c1range[0]));
+    scale[1] = histSize[1]/(1.0*(c2range[1]-c2range[0]));
+    shift[0] = -c1range[0]*scale[0];
+    shift[1] = -c2range[0]*scale[1];
+}
+
+/* bins a single image row the same way calcBackProject does for uniform histograms,
+   out of range pixels get the index one past the last bin. B is ushort for CV_16U bin images, whose geometry has to
+   pass BinIndexer::fits, or int for geometries of any size*/
+template<typename T, typename B>
+static void binRow(const T* row, int cols, int cn, const int channels[2], const int histSize[2], const double scale[2], const double shift[2], B* bins){
+    int outOfRange = histSize[0]*histSize[1];
+    for (int x=0; x<cols; x++){
+        int idx0 = cvFloor(row[x*cn+channels[0]]*scale[0]+shift[0]);
+        int idx1 = cvFloor(row[x*cn+channels[1]]*scale[1]+shift[1]);
+        if ((unsigned)idx0<(unsigned)histSize[0] && (unsigned)idx1<(unsigned)histSize[1]){
+            bins[x] = (B)(idx0*histSize[1]+idx1);
+        }
+        else {
+            bins[x] = (B)outOfRange;
+        }
+    }
+}
+
+/* copies histogram values into a flat lookup table with an extra zero entry for out of range bins*/
+static void makeBinLookup(const Mat histogram, std::vector<float>& lut){
+    Mat hist = histogram;
+    if (hist.type()!=CV_32F || !hist.isContinuous()){
+        histogram.convertTo(hist, CV_32F);
+    }
+    int numBins = hist.total();
+    lut.resize(numBins+1);
+    const float* histPtr = hist.ptr<float>(0);
+    std::copy(histPtr, histPtr+numBins, lut.begin());
+    lut[numBins] = 0.0f;
+}
+
+void Histogram::binIndices(const Mat image, const int channels[2], const int histSize[2], const float c1range[2], const float c2range[2], Mat& binImage){
+    double scale[2];
+    double shift[2];
+    binScaleShift(histSize, c1range, c2range, scale, shift);
+
+    int cn = image.channels();
+    binImage.create(image.size(), CV_16U);
+    for (int y=0; y<image.rows; y++){
+        if (image.depth()==CV_8U){
+            binRow(image.ptr<uchar>(y), image.cols, cn, channels, histSize, scale, shift, binImage.ptr<ushort>(y));
+        }
+        else {
+            binRow(image.ptr<float>(y), image.cols, cn, channels, histSize, scale, shift, binImage.ptr<ushort>(y));
+        }
+    }
+}
+
+void Histogram::binIndices(const Mat image, Mat& binImage) const{
+    binIndices(image, channels, histSize, c1range, c2range, binImage);
+}
+
+/* bin indexer for power of two bin counts over the 0-256 range of both channels, where the bin of a value is value>>(8-BITS)*/
+template<int C0, int C1, int BITS>
+class ShiftBinIndexer : public BinIndexer{
+public:
+    void binIndices(const Mat image, Mat& binImage) const{
+        const int shift = 8-BITS;
+        const ushort outOfRange = 1<<(2*BITS);
+        int cn = image.channels();
+        binImage.create(image.size(), CV_16U);
+        for (int y=0; y<image.rows; y++){
+            ushort* bins = binImage.ptr<ushort>(y);
+            if (image.depth()==CV_8U){
+                const uchar* row = image.ptr<uchar>(y);
+                for (int x=0; x<image.cols; x++){
+                    bins[x] = ((row[x*cn+C0]>>shift)<<BITS) | (row[x*cn+C1]>>shift);
+                }
+            }
+            else {
+                const float* row = image.ptr<float>(y);
+                for (int x=0; x<image.cols; x++){
+                    int v0 = cvFloor(row[x*cn+C0]);
+                    int v1 = cvFloor(row[x*cn+C1]);
+                    if ((unsigned)v0<256 && (unsigned)v1<256){
+                        bins[x] = ((v0>>shift)<<BITS) | (v1>>shift);
+                    }
+                    else {
+                        bins[x] = outOfRange;
+                    }
+                }
+            }
+        }
+    }
+    bool specialized() const{
+        return true;
+    }
+};
+
+class GenericBinIndexer : public BinIndexer{
+    int channels[2];
+    int histSize[2];
+    float c1range[2];
+    float c2range[2];
+public:
+    GenericBinIndexer(const int inchannels[2], const int histogramSize[2], const float channel1range[2], const float channel2range[2]){
+        channels[0] = inchannels[0]; channels[1] = inchannels[1];
+        histSize[0] = histogramSize[0]; histSize[1] = histogramSize[1];
+        c1range[0] = channel1range[0]; c1range[1] = channel1range[1];
+        c2range[0] = channel2range[0]; c2range[1] = channel2range[1];
+    }
+    void binIndices(const Mat image, Mat& binImage) const{
+        Histogram::binIndices(image, channels, histSize, c1range, c2range, binImage);
+    }
+    bool specialized() const{
+        return false;
+    }
+};
+
+template<int C0, int C1>
+static Ptr<BinIndexer> createShiftBinIndexer(int bins){
+    switch (bins){
+    case 32: return Ptr<BinIndexer>(new ShiftBinIndexer<C0,C1,5>());
+    case 64: return Ptr<BinIndexer>(new ShiftBinIndexer<C0,C1,6>());
+    case 128: return Ptr<BinIndexer>(new ShiftBinIndexer<C0,C1,7>());
+    default: return Ptr<BinIndexer>();
+    }
+}
+
+bool BinIndexer::fits(const int histSize[2]){
+    return histSize[0]>0 && histSize[1]>0 && histSize[0]*histSize[1]<65536;
+}
+
+Ptr<BinIndexer> BinIndexer::create(const int channels[2], const int histSize[2], const float c1range[2], const float c2range[2]){
+    Ptr<BinIndexer> indexer;
+    if (!fits(histSize)){
+        return indexer;
+    }
+    if (histSize[0]==histSize[1] && c1range[0]==0 && c1range[1]==256 && c2range[0]==0 && c2range[1]==256){
+        if (channels[0]==0 && channels[1]==1){
+            indexer = createShiftBinIndexer<0,1>(histSize[0]);
+        }
+        else if (channels[0]==1 && channels[1]==2){
+            indexer = createShiftBinIndexer<1,2>(histSize[0]);
+        }
+    }
+    if (indexer.empty()){
+        indexer = Ptr<BinIndexer>(new GenericBinIndexer(channels, histSize, c1range, c2range));
+    }
+    return indexer;
+}
+
+/* mirrors an index into [0,n) the way BORDER_REFLECT_101 does, n must be at least 3*/
+static inline int reflect101(int i, int n){
+    if (i<0) return -i;
+    if (i>=n) return 2*n-2-i;
+    return i;
+}
+
+/* fixed point BGR to YCrCb coefficients, identical to the ones cvtColor uses for 8-bit images*/
+static const int ycrcbShift = 14;
+static const int ycrcbB2Y = 1868;
+static const int ycrcbG2Y = 9617;
+static const int ycrcbR2Y = 4899;
+static const int ycrcbCr = 11682;
+static const int ycrcbCb = 9241;
+static const int ycrcbDelta = (128<<ycrcbShift) + (1<<(ycrcbShift-1));
+
+/* (v*blurDivMul)>>blurDivShift equals v/25 for every v up to 43689, which covers the rounded 5x5 sums of 8-bit pixels*/
+static const int blurDivMul = 5243;
+static const int blurDivShift = 17;
+
+/* streams the image once, keeping 5-row column sums which are updated by adding the entering row and subtracting the
+   leaving one, so each output row only touches two input rows and buffers of one row. Every row then goes through
+   separate passes over flat arrays without loop-carried dependencies, which the compiler vectorizes. The column sums
+   are split into one plane per channel, padded by two reflected pixels on each side, so the horizontal 5-tap sum with
+   its rounded division and the color conversion and binning run over contiguous arrays.*/
+template<int BITS>
+static void blurYCrCbBinsKernel(const Mat& image, Mat& binImage){
+    const int shift = 8-BITS;
+    int rows = image.rows;
+    int cols = image.cols;
+    int width = cols*3;
+    int paddedCols = cols+4;
+    binImage.create(image.size(), CV_16U);
+    std::vector<int> columnSums(width, 0);
+    std::vector<int> planes(paddedCols*3);
+    std::vector<int> blurred(cols*3);
+
+    for (int d=-2; d<=2; d++){
+        const uchar* row = image.ptr<uchar>(reflect101(d, rows));
+        for (int i=0; i<width; i++){
+            columnSums[i] += row[i];
+        }
+    }
+    for (int y=0; y<rows; y++){
+        if (y>0){
+            const uchar* entering = image.ptr<uchar>(reflect101(y+2, rows));
+            const uchar* leaving = image.ptr<uchar>(reflect101(y-3, rows));
+            int* sums = &columnSums[0];
+            for (int i=0; i<width; i++){
+                sums[i] += entering[i] - leaving[i];
+            }
+        }
+        const int* sums = &columnSums[0];
+        int* bluePlane = &planes[2];
+        int* greenPlane = &planes[paddedCols+2];
+        int* redPlane = &planes[2*paddedCols+2];
+        for (int x=0; x<cols; x++){
+            bluePlane[x] = sums[3*x];
+            greenPlane[x] = sums[3*x+1];
+            redPlane[x] = sums[3*x+2];
+        }
+        for (int c=0; c<3; c++){
+            int* plane = &planes[c*paddedCols+2];
+            plane[-2] = plane[2];
+            plane[-1] = plane[1];
+            plane[cols] = plane[cols-2];
+            plane[cols+1] = plane[cols-3];
+        }
+
+        //cvRound(sum/25) as in blur, exact since sum/25 never falls on a half
+        for (int c=0; c<3; c++){
+            const int* p = &planes[c*paddedCols];
+            int* out = &blurred[c*cols];
+            for (int x=0; x<cols; x++){
+                int sum = p[x] + p[x+1] + p[x+2] + p[x+3] + p[x+4];
+                out[x] = ((sum+12)*blurDivMul) >> blurDivShift;
+            }
+        }
+
+        const int* blue = &blurred[0];
+        const int* green = &blurred[cols];
+        const int* red = &blurred[2*cols];
+        ushort* bins = binImage.ptr<ushort>(y);
+        for (int x=0; x<cols; x++){
+            int luma = (blue[x]*ycrcbB2Y + green[x]*ycrcbG2Y + red[x]*ycrcbR2Y + (1<<(ycrcbShift-1))) >> ycrcbShift;
+            int cr = ((red[x]-luma)*ycrcbCr + ycrcbDelta) >> ycrcbShift;
+            int cb = ((blue[x]-luma)*ycrcbCb + ycrcbDelta) >> ycrcbShift;
+            cr = std::min(std::max(cr, 0), 255);
+            cb = std::min(std::max(cb, 0), 255);
+            bins[x] = ((cr>>shift)<<BITS) | (cb>>shift);
+        }
+    }
+}
+
+bool blurYCrCbBins(const Mat image, int bins, Mat& binImage){
+    if (image.type()!=CV_8UC3 || image.rows<3 || image.cols<3){
+        return false;
+    }
+    switch (bins){
+    case 32: blurYCrCbBinsKernel<5>(image, binImage); return true;
+    case 64: blurYCrCbBinsKernel<6>(image, binImage); return true;
+    case 128: blurYCrCbBinsKernel<7>(image, binImage); return true;
+    default: return false;
+    }
+}
+
+/* stretches 16-240 around the 128 offset to the 0-255 range cvtColor produces from BGR images*/
+static Mat makeChromaStretch(){
+    Mat table(1, 256, CV_8U);
+    for (int i=0; i<256; i++){
+        table.at<uchar>(i) = saturate_cast<uchar>((i-128)*255.0/224.0+128);
+    }
+    return table;
+}
+
+/* built before main, so the acquisition, display and tracking threads only ever read it*/
+static const Mat chromaStretch = makeChromaStretch();
+
+void yuv422Chroma(const Mat yuv422, Mat& chroma, bool limitedRange){
+    //each group of four bytes holds two pixels, Y0 U Y1 V, and both pixels of the group get its V and U
+    Mat groups(yuv422.rows, yuv422.cols/2, CV_8UC4, (void*)yuv422.data, yuv422.step);
+    chroma.create(yuv422.size(), CV_8UC2);
+    Mat pairs(groups.size(), CV_8UC4, chroma.data, chroma.step);
+    int fromTo[] = {3,0, 1,1, 3,2, 1,3};
+    mixChannels(&groups, 1, &pairs, 1, fromTo, 4);
+    if (limitedRange){
+        LUT(chroma, chromaStretch, chroma);
+    }
+}
+
+void chromaToBGR(const Mat chroma, Mat& bgr){
+    Mat ycrcb(chroma.size(), CV_8UC3, Scalar(128,128,128));
+    int fromTo[] = {0,1, 1,2};
+    mixChannels(&chroma, 1, &ycrcb, 1, fromTo, 2);
+    cvtColor(ycrcb, bgr, CV_YCrCb2BGR);
+}
+
+void Histogram::calcFromBins(const Mat binImage, const Mat mask, Mat& histogram) const{
+    calcFromBins(binImage, mask, histSize, histogram);
+}
+
+void Histogram::calcFromBins(const Mat binImage, const Mat mask, const int histSize[2], Mat& histogram){
+    int numBins = histSize[0]*histSize[1];
+    histogram.create(histSize[0], histSize[1], CV_32F);
+    histogram.setTo(Scalar(0));
+    float* hist = histogram.ptr<float>(0);
+    for (int y=0; y<binImage.rows; y++){
+        const ushort* bins = binImage.ptr<ushort>(y);
+        const uchar* maskRow = mask.empty() ? NULL : mask.ptr<uchar>(y);
+        for (int x=0; x<binImage.cols; x++){
+            if ((maskRow==NULL || maskRow[x]) && bins[x]<numBins){
+                hist[bins[x]] += 1.0f;
+            }
+        }
+    }
+}
+
+void Histogram::backPropagateBins(const Mat binImage, const std::vector<const Histogram*>& histograms, std::vector<Mat>& outputImages){
+    int numHist = histograms.size();
+    outputImages.resize(numHist);
+    std::vector<std::vector<float> > luts(numHist);
+    for (int k=0; k<numHist; k++){
+        makeBinLookup(histograms[k]->normalized, luts[k]);
+        outputImages[k].create(binImage.size(), CV_32F);
+    }
+
+    for (int y=0; y<binImage.rows; y++){
+        const ushort* bins = binImage.ptr<ushort>(y);
+        for (int k=0; k<numHist; k++){
+            const float* lut = &luts[k][0];
+            float* out = outputImages[k].ptr<float>(y);
+            for (int x=0; x<binImage.cols; x++){
+                out[x] = lut[bins[x]];
+            }
+        }
+    }
+}
+
+void Histogram::quantize(){
+    normalized.convertTo(quantized, CV_8U, 255.0);
+    changes++;
+}
+
+unsigned int Histogram::revision() const{
+    return changes;
+}
+
+void Histogram::backPropagateQuantized(const Mat binImage, const std::vector<const Histogram*>& histograms, std::vector<Mat>& outputImages){
+    int numHist = histograms.size();
+    outputImages.resize(numHist);
+    std::vector<std::vector<uchar> > luts(numHist);
+    for (int k=0; k<numHist; k++){
+        const Mat& hist = histograms[k]->quantized;
+        int numBins = hist.total();
+        luts[k].resize(numBins+1);
+        for (int i=0; i<hist.rows; i++){
+            const uchar* histRow = hist.ptr<uchar>(i);
+            std::copy(histRow, histRow+hist.cols, luts[k].begin()+i*hist.cols);
+        }
+        luts[k][numBins] = 0;
+        outputImages[k].create(binImage.size(), CV_8U);
+    }
+
+    //there is no byte gather for a 4 KB table in SSE or NEON, so the lookup is unrolled to keep the loads independent
+    for (int y=0; y<binImage.rows; y++){
+        const ushort* bins = binImage.ptr<ushort>(y);
+        for (int k=0; k<numHist; k++){
+            const uchar* lut = &luts[k][0];
+            uchar* out = outputImages[k].ptr<uchar>(y);
+            int x = 0;
+            for (; x<=binImage.cols-4; x+=4){
+                uchar v0 = lut[bins[x]];
+                uchar v1 = lut[bins[x+1]];
+                uchar v2 = lut[bins[x+2]];
+                uchar v3 = lut[bins[x+3]];
+                out[x] = v0; out[x+1] = v1; out[x+2] = v2; out[x+3] = v3;
+            }
+            for (; x<binImage.cols; x++){
+                out[x] = lut[bins[x]];
+            }
+        }
+    }
+}
+
+void Histogram::backPropagate(const Mat inputImage, const std::vector<const Histogram*>& histograms, std::vector<Mat>& outputImages){
+    int numHist = histograms.size();
+    outputImages.resize(numHist);
+    if (numHist==0){
+        return;
+    }
+
+    const Histogram* geometry = histograms[0];
+    double scale[2];
+    double shift[2];
+    binScaleShift(geometry->histSize, geometry->c1range, geometry->c2range, scale, shift);
+
+    std::vector<std::vector<float> > luts(numHist);
+    for (int k=0; k<numHist; k++){
+        makeBinLookup(histograms[k]->normalized, luts[k]);
+        outputImages[k].create(inputImage.size(), CV_32F);
+    }
+
+    //int indices, so geometries too large for a CV_16U bin image work as well
+    int cn = inputImage.channels();
+    std::vector<int> bins(inputImage.cols);
+    for (int y=0; y<inputImage.rows; y++){
+        if (inputImage.depth()==CV_8U){
+            binRow(inputImage.ptr<uchar>(y), inputImage.cols, cn, geometry->channels, geometry->histSize, scale, shift, &bins[0]);
+        }
+        else {
+            binRow(inputImage.ptr<float>(y), inputImage.cols, cn, geometry->channels, geometry->histSize, scale, shift, &bins[0]);
+        }
+        for (int k=0; k<numHist; k++){
+            const float* lut = &luts[k][0];
+            float* out = outputImages[k].ptr<float>(y);
+            for (int x=0; x<inputImage.cols; x++){
+                out[x] = lut[bins[x]];
+            }
+        }
+    }
+}
+
+const GaussianMixtureModel& Histogram::model() const{
+    return gmm;
+}
+
+void Histogram::makeGMM(int K, int maxIter = 10, double minStepIncrease = 0.01, int threads){
+    gmm = GaussianMixtureModel(2,K,threads);
+    gmm.fromHistogram(counts(), histSize, c1range, c2range, maxIter, minStepIncrease);
+    if (!gmm.initialized){
+        gmmReady = false;
+        return;
+    }
+    useGMMLookup();
+}
+
+bool Histogram::selectGMM(int maxK, int maxIter, double minStepIncrease, double bicTolerance, int threads){
+    Mat samples = counts();
+    //an empty histogram has nothing to fit, every candidate would keep its unfitted components
+    if (samples.empty() || !(sum(samples)[0]>0)){
+        return false;
+    }
+    //a single component is always tried, so there is a model to choose
+    maxK = std::max(maxK, 1);
+    threads = std::max(threads, 1);
+    //threads is the budget for the whole selection, split between the candidates fitted at the same time
+    int concurrent = std::min(maxK, threads);
+    int emThreads = std::max(1, threads/concurrent);
+    std::vector<GaussianMixtureModel> candidates;
+    for (int K=1; K<=maxK; K++){
+        candidates.push_back(GaussianMixtureModel(2,K,emThreads));
+    }
+    //candidates only read the shared histogram, so each one in a wave can be fitted on its own thread
+    for (int first=0; first<candidates.size(); first+=concurrent){
+        int last = std::min((int)candidates.size(), first+concurrent);
+        boost::thread_group workers;
+        for (int i=first+1; i<last; i++){
+            workers.create_thread(boost::bind(&GaussianMixtureModel::fitHistogram, &candidates[i], samples, histSize, c1range, c2range,
+                                              maxIter, minStepIncrease));
+        }
+        candidates[first].fitHistogram(samples, histSize, c1range, c2range, maxIter, minStepIncrease);
+        workers.join_all();
+    }
+
+    //only fitted candidates are scored, an unfitted one keeps the BIC of 0 its constructor sets
+    int best = -1;
+    for (int i=0; i<candidates.size(); i++){
+        if (candidates[i].initialized && (best<0 || candidates[i].fitBIC<candidates[best].fitBIC)){
+            best = i;
+        }
+    }
+    if (best<0){
+        return false;
+    }
+    int chosen = 0;
+    while (!candidates[chosen].initialized || candidates[chosen].fitBIC > candidates[best].fitBIC+bicTolerance){
+        chosen++;
+    }
+    gmm = candidates[chosen];
+    gmm.makeLookup(histSize, c1range, c2range);
+    useGMMLookup();
+    return true;
+}
+
+bool Histogram::updateGMM(const Mat histogram, double stepSize, Mat& smoothed){
+    if (!gmmReady || !gmm.stepwiseUpdate(histogram, histSize, c1range, c2range, stepSize)){
+        return false;
+    }
+    gmm.lookup.copyTo(smoothed);
+    return true;
+}
+
+void Histogram::useGMMLookup(){
     gmmReady = true;
-    
+
     Mat hist = gmm.lookup;
     double histMax = 0;
     double histMin = 0;
     minMaxLoc(hist, &histMin, &histMax, NULL, NULL);
     hist.convertTo(normalized,CV_32F,1/(histMax-histMin),-histMin/(histMax-histMin));
+    quantize();
+}
+
+void Histogram::writeBinary(std::ostream& out, const Mat histogram) const{
+    out.write(modelMagic, sizeof(modelMagic));
+    writeValue(out, modelVersion);
+    for (int i=0; i<2; i++){
+        writeValue(out, histSize[i]);
+    }
+    for (int i=0; i<2; i++){
+        writeValue(out, channels[i]);
+    }
+    for (int i=0; i<2; i++){
+        writeValue(out, c1range[i]);
+    }
+    for (int i=0; i<2; i++){
+        writeValue(out, c2range[i]);
+    }
+    Mat hist;
+    histogram.convertTo(hist, CV_32F);
+    for (int i=0; i<hist.rows; i++){
+        out.write(hist.ptr<char>(i), hist.cols*sizeof(float));
+    }
+    gmm.writeBinary(out);
+}
+
+bool Histogram::readBinary(const char*& data, const char* end, Mat& histogram){
+    const char* pos = data;
+    if (end-pos < (ptrdiff_t)sizeof(modelMagic) || memcmp(pos, modelMagic, sizeof(modelMagic))!=0){
+        return false;
+    }
+    pos += sizeof(modelMagic);
+    int version = 0;
+    if (!readValue(pos, end, version) || version!=modelVersion){
+        return false;
+    }
+
+    int storedSize[2];
+    int storedChannels[2];
+    float storedC1range[2];
+    float storedC2range[2];
+    bool ok = true;
+    for (int i=0; i<2; i++){
+        ok = ok && readValue(pos, end, storedSize[i]);
+    }
+    for (int i=0; i<2; i++){
+        ok = ok && readValue(pos, end, storedChannels[i]);
+    }
+    for (int i=0; i<2; i++){
+        ok = ok && readValue(pos, end, storedC1range[i]);
+    }
+    for (int i=0; i<2; i++){
+        ok = ok && readValue(pos, end, storedC2range[i]);
+    }
+    if (!ok){
+        return false;
+    }
+    for (int i=0; i<2; i++){
+        if (storedSize[i]!=histSize[i] || storedChannels[i]!=channels[i] || storedC1range[i]!=c1range[i] || storedC2range[i]!=c2range[i]){
+            return false;
+        }
+    }
+
+    size_t histBytes = (size_t)histSize[0]*histSize[1]*sizeof(float);
+    if (end-pos < (ptrdiff_t)histBytes){
+        return false;
+    }
+    Mat hist(histSize[0], histSize[1], CV_32F);
+    memcpy(hist.ptr<char>(0), pos, histBytes);
+    pos += histBytes;
+
+    GaussianMixtureModel storedGMM;
+    //the lookup table and the two-dimensional EM path index two-dimensional means
+    if (!storedGMM.readBinary(pos, end) || (storedGMM.initialized && storedGMM.numDimensions()!=2)){
+        return false;
+    }
+
+    gmm = storedGMM;
+    gmmReady = gmm.initialized;
+    histogram = hist;
+    data = pos;
+    return true;
 }
 
 void Histogram::resize(int histogramSize[2]){
@@ -104,11 +779,19 @@ void Histogram::resize(int histogramSize[2]){
 
 GaussianMixtureModel::GaussianMixtureModel(){
     initialized = false;
+    threads = 1;
+    fitIterations = 0;
+    fitLogLikelihood = 0;
+    fitBIC = 0;
 }
 
-GaussianMixtureModel::GaussianMixtureModel(int dims, int K){
+GaussianMixtureModel::GaussianMixtureModel(int dims, int K, int numThreads){
     dimensions=dims;
     components=K;
+    threads=numThreads;
+    fitIterations=0;
+    fitLogLikelihood=0;
+    fitBIC=0;
     for (int i=0; i<K; i++){
         covarianceMatrix.push_back(Mat::eye(dims, dims, CV_64F)*500);
         if (i==0){
@@ -127,6 +810,11 @@ GaussianMixtureModel::GaussianMixtureModel(const GaussianMixtureModel& other){
     components = other.components;
     weight = other.weight;
     initialized = other.initialized;
+    threads = other.threads;
+    fitIterations = other.fitIterations;
+    fitLogLikelihood = other.fitLogLikelihood;
+    fitBIC = other.fitBIC;
+    onlineStatistics = other.onlineStatistics;
     covarianceMatrix.clear();
     for(int i=0; i<other.covarianceMatrix.size(); i++){
         Mat temp;
@@ -149,6 +837,11 @@ GaussianMixtureModel& GaussianMixtureModel::operator=(const GaussianMixtureModel
         components = other.components;
         weight = other.weight;
         initialized = other.initialized;
+        threads = other.threads;
+        fitIterations = other.fitIterations;
+        fitLogLikelihood = other.fitLogLikelihood;
+        fitBIC = other.fitBIC;
+        onlineStatistics = other.onlineStatistics;
         covarianceMatrix.clear();
         for(int i=0; i<other.covarianceMatrix.size(); i++){
             Mat temp;
@@ -168,8 +861,353 @@ GaussianMixtureModel& GaussianMixtureModel::operator=(const GaussianMixtureModel
     return *this;
 }
 
+/* two-dimensional gaussian component with its inverse covariance [a b; b c] and weight/normalizer precomputed*/
+struct GaussianComponent2D{
+    double weight;
+    double meanX, meanY;
+    double covXX, covXY, covYY;
+    double invA, invB, invC;
+    double norm;
+};
+
+/* weighted sums over samples needed for one EM M-step, plus the log likelihood of the model they were computed with*/
+struct EMStatistics2D{
+    std::vector<double> n, sx, sy, sxx, sxy, syy;
+    double logLikelihood;
+    void reset(int K){
+        n.assign(K, 0.0); sx.assign(K, 0.0); sy.assign(K, 0.0);
+        sxx.assign(K, 0.0); sxy.assign(K, 0.0); syy.assign(K, 0.0);
+        logLikelihood = 0.0;
+    }
+};
+
+/* regularization added to covariance diagonals so components collapsing onto a single histogram bin stay invertible*/
+static const double minVariance2D = 1e-3;
+
+static bool prepareComponent2D(GaussianComponent2D& c){
+    double det = c.covXX*c.covYY - c.covXY*c.covXY;
+    if (!(det>0)){
+        return false;
+    }
+    c.invA = c.covYY/det;
+    c.invB = -c.covXY/det;
+    c.invC = c.covXX/det;
+    c.norm = c.weight/(2*3.141592653589793238463*sqrt(det));
+    return true;
+}
+
+/* E-step over samples [begin,end) fused with the accumulation of M-step sums. prob is scratch space for K values*/
+static void accumulateEMStatistics2D(const float* xs, const float* ys, const float* ws, int begin, int end,
+                                     const std::vector<GaussianComponent2D>& comps, double* prob, EMStatistics2D& stats){
+    int K = comps.size();
+    for (int i=begin; i<end; i++){
+        double x = xs[i];
+        double y = ys[i];
+        double sum = 0;
+        for (int k=0; k<K; k++){
+            const GaussianComponent2D& c = comps[k];
+            double dx = x-c.meanX;
+            double dy = y-c.meanY;
+            double q = c.invA*dx*dx + 2*c.invB*dx*dy + c.invC*dy*dy;
+            prob[k] = c.norm*exp(-0.5*q);
+            sum += prob[k];
+        }
+        double scale;
+        if (sum>1e-300){
+            scale = ws[i]/sum;
+            stats.logLikelihood += ws[i]*log(sum);
+        }
+        else {
+            for (int k=0; k<K; k++){
+                prob[k] = 1.0;
+            }
+            scale = ws[i]/K;
+            stats.logLikelihood += ws[i]*log(1e-300);
+        }
+        for (int k=0; k<K; k++){
+            double r = prob[k]*scale;
+            stats.n[k] += r;
+            stats.sx[k] += r*x;
+            stats.sy[k] += r*y;
+            stats.sxx[k] += r*x*x;
+            stats.sxy[k] += r*x*y;
+            stats.syy[k] += r*y*y;
+        }
+    }
+}
+
+/* M-step from accumulated sums. Components without any responsibility keep their previous parameters*/
+static void maximizeComponents2D(const EMStatistics2D& stats, double totalWeight, std::vector<GaussianComponent2D>& comps){
+    for (int k=0; k<comps.size(); k++){
+        GaussianComponent2D c = comps[k];
+        double n = stats.n[k];
+        if (n<=1e-12*totalWeight){
+            continue;
+        }
+        c.weight = n/totalWeight;
+        c.meanX = stats.sx[k]/n;
+        c.meanY = stats.sy[k]/n;
+        c.covXX = stats.sxx[k]/n - c.meanX*c.meanX + minVariance2D;
+        c.covXY = stats.sxy[k]/n - c.meanX*c.meanY;
+        c.covYY = stats.syy[k]/n - c.meanY*c.meanY + minVariance2D;
+        if (prepareComponent2D(c)){
+            comps[k] = c;
+        }
+    }
+}
+
+/* seed used for k-means++ initialization, fixed so that fitting the same histogram always gives the same model*/
+static const uint64 emSeed = 0x4e414f47;
+
+/* weighted k-means++ seeding. Means are picked among the samples with probability proportional to the sample weight
+   times the squared distance to the closest mean picked so far. Every sample is then assigned to its closest mean and
+   the weights and covariances are initialized from these assignments*/
+static void seedComponents2D(const float* xs, const float* ys, const float* ws, int N, double totalWeight, int K,
+                             std::vector<GaussianComponent2D>& comps){
+    RNG rng(emSeed);
+    std::vector<double> seedX, seedY;
+    std::vector<double> minDist(N, -1.0);
+    for (int k=0; k<K; k++){
+        double total = 0;
+        for (int i=0; i<N; i++){
+            if (k>0){
+                double dx = xs[i]-seedX[k-1];
+                double dy = ys[i]-seedY[k-1];
+                double d = dx*dx+dy*dy;
+                if (minDist[i]<0 || d<minDist[i]) {minDist[i] = d;}
+            }
+            total += k>0 ? ws[i]*minDist[i] : ws[i];
+        }
+        int pick = N-1;
+        if (total>0){
+            double target = rng.uniform(0.0, total);
+            double cumulative = 0;
+            for (int i=0; i<N; i++){
+                cumulative += k>0 ? ws[i]*minDist[i] : ws[i];
+                if (cumulative>target){
+                    pick = i;
+                    break;
+                }
+            }
+        }
+        seedX.push_back(xs[pick]);
+        seedY.push_back(ys[pick]);
+    }
+
+    EMStatistics2D stats;
+    stats.reset(K);
+    double gx = 0, gy = 0, gxx = 0, gxy = 0, gyy = 0;
+    for (int i=0; i<N; i++){
+        int closest = 0;
+        double closestDist = -1;
+        for (int k=0; k<K; k++){
+            double dx = xs[i]-seedX[k];
+            double dy = ys[i]-seedY[k];
+            double d = dx*dx+dy*dy;
+            if (closestDist<0 || d<closestDist){
+                closestDist = d;
+                closest = k;
+            }
+        }
+        double w = ws[i];
+        stats.n[closest] += w;
+        stats.sx[closest] += w*xs[i]; stats.sy[closest] += w*ys[i];
+        stats.sxx[closest] += w*xs[i]*xs[i]; stats.sxy[closest] += w*xs[i]*ys[i]; stats.syy[closest] += w*ys[i]*ys[i];
+        gx += w*xs[i]; gy += w*ys[i];
+        gxx += w*xs[i]*xs[i]; gxy += w*xs[i]*ys[i]; gyy += w*ys[i]*ys[i];
+    }
+
+    //components that got no samples, or whose samples all lie on a line, start with the covariance of the whole dataset
+    GaussianComponent2D global;
+    global.weight = 1.0/K;
+    global.meanX = gx/totalWeight;
+    global.meanY = gy/totalWeight;
+    global.covXX = gxx/totalWeight - global.meanX*global.meanX + minVariance2D;
+    global.covXY = gxy/totalWeight - global.meanX*global.meanY;
+    global.covYY = gyy/totalWeight - global.meanY*global.meanY + minVariance2D;
+    if (!prepareComponent2D(global)){
+        global.covXX = 500; global.covXY = 0; global.covYY = 500;
+        prepareComponent2D(global);
+    }
+
+    comps.assign(K, global);
+    for (int k=0; k<K; k++){
+        GaussianComponent2D& c = comps[k];
+        c.meanX = seedX[k];
+        c.meanY = seedY[k];
+        c.weight = std::max(stats.n[k]/totalWeight, 1e-6);
+        if (stats.n[k]>0){
+            double n = stats.n[k];
+            GaussianComponent2D candidate = c;
+            candidate.meanX = stats.sx[k]/n;
+            candidate.meanY = stats.sy[k]/n;
+            candidate.covXX = stats.sxx[k]/n - candidate.meanX*candidate.meanX + minVariance2D;
+            candidate.covXY = stats.sxy[k]/n - candidate.meanX*candidate.meanY;
+            candidate.covYY = stats.syy[k]/n - candidate.meanY*candidate.meanY + minVariance2D;
+            //a single bin has next to no spread, so the covariance is only taken if it is comparable to a bin's size
+            if (candidate.covXX>1.0 && candidate.covYY>1.0 && prepareComponent2D(candidate)){
+                c = candidate;
+                continue;
+            }
+        }
+        prepareComponent2D(c);
+    }
+}
+
+/* persistent EM worker for the samples [begin,end). Every iteration it waits at start until the main thread has published
+   the components, accumulates its block and meets the main thread again at done. It returns when stop is set at start*/
+struct EMWorker2D{
+    const float *xs, *ys, *ws;
+    int begin, end;
+    const std::vector<GaussianComponent2D>* comps;
+    double* prob;
+    EMStatistics2D* stats;
+    boost::barrier *start, *done;
+    const bool* stop;
+
+    void operator()() const{
+        while (true){
+            start->wait();
+            if (*stop){
+                return;
+            }
+            accumulateEMStatistics2D(xs, ys, ws, begin, end, *comps, prob, *stats);
+            done->wait();
+        }
+    }
+};
+
+/* unpacks the non-empty bins of a two-dimensional CV_32F or CV_64F histogram into bin centers and weights, returns the
+   total weight*/
+static double histogramSamples2D(const Mat histogram, int histSize[2], float c1range[2], float c2range[2],
+                                 std::vector<float>& xs, std::vector<float>& ys, std::vector<float>& ws){
+    float dim1step = (c1range[1]-c1range[0])/(1.0*histSize[0]);
+    float dim2step = (c2range[1]-c2range[0])/(1.0*histSize[1]);
+    float dim1start = c1range[0]+dim1step/2.0;
+    float dim2start = c2range[0]+dim2step/2.0;
+    Mat hist = histogram;
+    if (hist.depth()!=CV_32F){
+        histogram.convertTo(hist, CV_32F);
+    }
+    xs.clear(); ys.clear(); ws.clear();
+    double totalWeight = 0;
+    for (int i=0; i<histSize[0]; i++){
+        const float* row = hist.ptr<float>(i);
+        for (int j=0; j<histSize[1]; j++){
+            if (row[j]>0){
+                xs.push_back(dim1start+i*dim1step);
+                ys.push_back(dim2start+j*dim2step);
+                ws.push_back(row[j]);
+                totalWeight += row[j];
+            }
+        }
+    }
+    return totalWeight;
+}
+
+bool GaussianMixtureModel::runExpectationMaximization2D(const Mat samples, int maxIterations, double minStepIncrease){
+    int N = samples.rows;
+    std::vector<float> xs(N), ys(N), ws(N);
+    for (int i=0; i<N; i++){
+        const double* row = samples.ptr<double>(i);
+        xs[i] = row[0];
+        ys[i] = row[1];
+        ws[i] = row[2];
+    }
+    return fitSamples2D(xs, ys, ws, maxIterations, minStepIncrease);
+}
+
+bool GaussianMixtureModel::fitSamples2D(const std::vector<float>& xs, const std::vector<float>& ys, const std::vector<float>& ws,
+                                        int maxIterations, double minStepIncrease){
+    int N = ws.size();
+    int K = components;
+    double totalWeight = 0;
+    for (int i=0; i<N; i++){
+        totalWeight += ws[i];
+    }
+    if (N==0 || totalWeight<=0){
+        return false;
+    }
+
+    std::vector<GaussianComponent2D> comps;
+    seedComponents2D(&xs[0], &ys[0], &ws[0], N, totalWeight, K, comps);
+
+    //every worker gets a contiguous block of samples and its own sums and scratch space
+    int numThreads = std::max(1, std::min(threads, N));
+    std::vector<EMStatistics2D> partial(numThreads);
+    std::vector<std::vector<double> > prob(numThreads, std::vector<double>(K));
+    std::vector<int> blockStart(numThreads+1);
+    for (int t=0; t<=numThreads; t++){
+        blockStart[t] = (int)((long long)t*N/numThreads);
+    }
+
+    //workers live for the whole fit and are synchronized once per iteration, the main thread takes the first block
+    boost::barrier start(numThreads), done(numThreads);
+    bool stop = false;
+    boost::thread_group workers;
+    for (int t=1; t<numThreads; t++){
+        EMWorker2D worker = {&xs[0], &ys[0], &ws[0], blockStart[t], blockStart[t+1], &comps, &prob[t][0], &partial[t],
+                             &start, &done, &stop};
+        workers.create_thread(worker);
+    }
+
+    EMStatistics2D stats;
+    double lastLogLikelihood = 0;
+    fitIterations = 0;
+    //every pass evaluates the parameters of the previous M-step, so the loop stops at an E-step and the log likelihood it
+    //leaves in stats always belongs to the returned model, also when maxIterations is exhausted
+    for (int step=0; ; step++){
+        for (int t=0; t<numThreads; t++){
+            partial[t].reset(K);
+        }
+        start.wait();
+        accumulateEMStatistics2D(&xs[0], &ys[0], &ws[0], blockStart[0], blockStart[1], comps, &prob[0][0], partial[0]);
+        done.wait();
+        //reduction in block order keeps the result independent of thread scheduling
+        stats = partial[0];
+        for (int t=1; t<numThreads; t++){
+            for (int k=0; k<K; k++){
+                stats.n[k] += partial[t].n[k];
+                stats.sx[k] += partial[t].sx[k];
+                stats.sy[k] += partial[t].sy[k];
+                stats.sxx[k] += partial[t].sxx[k];
+                stats.sxy[k] += partial[t].sxy[k];
+                stats.syy[k] += partial[t].syy[k];
+            }
+            stats.logLikelihood += partial[t].logLikelihood;
+        }
+        if (step==maxIterations || (step>0 && stats.logLikelihood-lastLogLikelihood < minStepIncrease*fabs(lastLogLikelihood))){
+            break;
+        }
+        lastLogLikelihood = stats.logLikelihood;
+        maximizeComponents2D(stats, totalWeight, comps);
+        fitIterations++;
+    }
+    stop = true;
+    start.wait();
+    workers.join_all();
+    fitLogLikelihood = stats.logLikelihood;
+    //sample weights are rescaled to sum to the number of samples, so the criterion does not depend on the histogram's scale
+    int parameters = 6*K-1;
+    fitBIC = -2*fitLogLikelihood*N/totalWeight + parameters*log((double)N);
+
+    for (int k=0; k<K; k++){
+        const GaussianComponent2D& c = comps[k];
+        weight[k] = c.weight;
+        meanVector[k] = (Mat_<double>(2,1) << c.meanX, c.meanY);
+        covarianceMatrix[k] = (Mat_<double>(2,2) << c.covXX, c.covXY, c.covXY, c.covYY);
+    }
+    return true;
+}
+
 /* matrix samples is a N X (M+1) matrix, consisting of N M-dimensional samples. The last row-element is the number of identical samples*/
 void GaussianMixtureModel::runExpectationMaximization(const Mat samples, int maxIterations, double minStepIncrease){
+    if (dimensions==2){
+        if (runExpectationMaximization2D(samples, maxIterations, minStepIncrease)){
+            initialized = true;
+        }
+        return;
+    }
     if (true){
         //componentProbability = Mat::ones(samples.rows, components, CV_64F)/(1.0*components);
         initialized = true;
@@ -335,6 +1373,14 @@ double GaussianMixtureModel::gaussIdx(const Mat x, int componentIndex){
     else {return -1;}
 }
 
+int GaussianMixtureModel::numComponents() const{
+    return components;
+}
+
+int GaussianMixtureModel::numDimensions() const{
+    return dimensions;
+}
+
 double GaussianMixtureModel::get(Mat x){
     double retVal = 0;
     for (int k=0; k<components; k++){
@@ -345,7 +1391,151 @@ double GaussianMixtureModel::get(Mat x){
     return retVal;
 }
 
+/* converts stored model parameters to two-dimensional components, skipping singular ones*/
+static void loadComponents2D(const std::vector<double>& weight, const std::vector<Mat>& meanVector, const std::vector<Mat>& covarianceMatrix,
+                             std::vector<GaussianComponent2D>& comps){
+    comps.clear();
+    for (int k=0; k<weight.size(); k++){
+        GaussianComponent2D c;
+        c.weight = weight[k];
+        c.meanX = meanVector[k].at<double>(0);
+        c.meanY = meanVector[k].at<double>(1);
+        c.covXX = covarianceMatrix[k].at<double>(0,0);
+        c.covXY = covarianceMatrix[k].at<double>(0,1);
+        c.covYY = covarianceMatrix[k].at<double>(1,1);
+        if (prepareComponent2D(c)){
+            comps.push_back(c);
+        }
+    }
+}
+
+bool GaussianMixtureModel::stepwiseUpdate(const Mat histogram, int histSize[2], float c1range[2], float c2range[2], double stepSize){
+    if (!initialized || dimensions!=2){
+        return false;
+    }
+    int K = components;
+    std::vector<GaussianComponent2D> comps;
+    loadComponents2D(weight, meanVector, covarianceMatrix, comps);
+    //the running statistics are kept per stored component, so a model with a singular component is not updated
+    if (comps.size()!=K){
+        return false;
+    }
+
+    //running statistics start out as the expected statistics of the current model per unit of sample weight
+    if (onlineStatistics.size()!=6*K){
+        onlineStatistics.resize(6*K);
+        for (int k=0; k<K; k++){
+            const GaussianComponent2D& c = comps[k];
+            double* st = &onlineStatistics[6*k];
+            st[0] = c.weight;
+            st[1] = c.weight*c.meanX;
+            st[2] = c.weight*c.meanY;
+            st[3] = c.weight*(c.covXX + c.meanX*c.meanX);
+            st[4] = c.weight*(c.covXY + c.meanX*c.meanY);
+            st[5] = c.weight*(c.covYY + c.meanY*c.meanY);
+        }
+    }
+
+    std::vector<float> xs, ys, ws;
+    double totalWeight = histogramSamples2D(histogram, histSize, c1range, c2range, xs, ys, ws);
+    if (totalWeight<=0){
+        return false;
+    }
+
+    //one E-step over the new histogram, blended into the running statistics, followed by an M-step
+    EMStatistics2D batch;
+    batch.reset(K);
+    std::vector<double> prob(K);
+    accumulateEMStatistics2D(&xs[0], &ys[0], &ws[0], 0, xs.size(), comps, &prob[0], batch);
+    EMStatistics2D stats;
+    stats.reset(K);
+    for (int k=0; k<K; k++){
+        double* st = &onlineStatistics[6*k];
+        st[0] = (1-stepSize)*st[0] + stepSize*batch.n[k]/totalWeight;
+        st[1] = (1-stepSize)*st[1] + stepSize*batch.sx[k]/totalWeight;
+        st[2] = (1-stepSize)*st[2] + stepSize*batch.sy[k]/totalWeight;
+        st[3] = (1-stepSize)*st[3] + stepSize*batch.sxx[k]/totalWeight;
+        st[4] = (1-stepSize)*st[4] + stepSize*batch.sxy[k]/totalWeight;
+        st[5] = (1-stepSize)*st[5] + stepSize*batch.syy[k]/totalWeight;
+        stats.n[k] = st[0]; stats.sx[k] = st[1]; stats.sy[k] = st[2];
+        stats.sxx[k] = st[3]; stats.sxy[k] = st[4]; stats.syy[k] = st[5];
+    }
+    maximizeComponents2D(stats, 1.0, comps);
+
+    for (int k=0; k<K; k++){
+        const GaussianComponent2D& c = comps[k];
+        weight[k] = c.weight;
+        meanVector[k] = (Mat_<double>(2,1) << c.meanX, c.meanY);
+        covarianceMatrix[k] = (Mat_<double>(2,2) << c.covXX, c.covXY, c.covXY, c.covYY);
+    }
+    makeLookup2D(histSize, c1range, c2range);
+    return true;
+}
+
+void GaussianMixtureModel::makeLookup2D(int histSize[2], float c1range[2], float c2range[2]){
+    int rows = histSize[0];
+    int cols = histSize[1];
+    double dim1step = (c1range[1]-c1range[0])/(1.0*rows);
+    double dim2step = (c2range[1]-c2range[0])/(1.0*cols);
+    double dim1start = c1range[0]+dim1step/2.0;
+    double dim2start = c2range[0]+dim2step/2.0;
+
+    //the exponent of component k at bin (i,j) is r0(i) + r1(i)*dy[j] + g[j], with dy[j] the distance of column j from
+    //the component's second mean coordinate and g[j] = -0.5*invC*dy[j]^2, so dy and g are tabulated once per component
+    std::vector<GaussianComponent2D> comps;
+    loadComponents2D(weight, meanVector, covarianceMatrix, comps);
+    int K = comps.size();
+    std::vector<float> dy(K*cols);
+    std::vector<float> g(K*cols);
+    for (int k=0; k<K; k++){
+        for (int j=0; j<cols; j++){
+            double d = dim2start+j*dim2step-comps[k].meanY;
+            dy[k*cols+j] = d;
+            g[k*cols+j] = -0.5*comps[k].invC*d*d;
+        }
+    }
+
+    lookup.create(rows, cols, CV_32F);
+    Mat exponent(1, cols, CV_32F);
+    Mat density(1, cols, CV_32F);
+    float* arg = exponent.ptr<float>(0);
+    const float* val = density.ptr<float>(0);
+    for (int i=0; i<rows; i++){
+        float* out = lookup.ptr<float>(i);
+        for (int j=0; j<cols; j++){
+            out[j] = 0.0f;
+        }
+        double x = dim1start+i*dim1step;
+        for (int k=0; k<K; k++){
+            double dx = x-comps[k].meanX;
+            float r0 = -0.5*comps[k].invA*dx*dx;
+            float r1 = -comps[k].invB*dx;
+            float norm = comps[k].norm;
+            const float* dyk = &dy[k*cols];
+            const float* gk = &g[k*cols];
+            for (int j=0; j<cols; j++){
+                arg[j] = r0 + r1*dyk[j] + gk[j];
+            }
+            exp(exponent, density);
+            for (int j=0; j<cols; j++){
+                out[j] += norm*val[j];
+            }
+        }
+    }
+
+    double histMax = 0;
+    double histMin = 0;
+    minMaxLoc(lookup, &histMin, &histMax, NULL, NULL);
+    //a flat lookup, e.g. every bin underflowing to zero for components far outside the range, has no maximum to scale to
+    double lookupScale = histMax>histMin ? 1/(histMax-histMin) : 0;
+    lookup.convertTo(lookup,CV_32F,lookupScale,-histMin*lookupScale);
+}
+
 void GaussianMixtureModel::makeLookup(int histSize[2], float c1range[2], float c2range[2]){
+    if (dimensions==2){
+        makeLookup2D(histSize, c1range, c2range);
+        return;
+    }
     Mat newLookup(histSize[0], histSize[1], CV_64F);
     float dim1step = (c1range[1]-c1range[0])/(1.0*histSize[0]);
     float dim2step = (c2range[1]-c2range[0])/(1.0*histSize[1]);
@@ -363,30 +1553,93 @@ void GaussianMixtureModel::makeLookup(int histSize[2], float c1range[2], float c
     double histMax = 0;
     double histMin = 0;
     minMaxLoc(lookup, &histMin, &histMax, NULL, NULL);
-    lookup.convertTo(lookup,CV_64F,1/(histMax-histMin),-histMin/(histMax-histMin));
+    double lookupScale = histMax>histMin ? 1/(histMax-histMin) : 0;
+    lookup.convertTo(lookup,CV_32F,lookupScale,-histMin*lookupScale);
 }
 
 void GaussianMixtureModel::fromHistogram(const Mat histogram, int histSize[2], float c1range[2], float c2range[2], int maxIter=10, double minStepIncrease = 0.01){
-    float dim1step = (c1range[1]-c1range[0])/(1.0*histSize[0]);
-    float dim2step = (c2range[1]-c2range[0])/(1.0*histSize[1]);
-    float dim1start = c1range[0]+dim1step/2.0;
-    float dim2start = c2range[0]+dim2step/2.0;
-    Mat samples;
-    for (int i=0; i<histSize[0]; i++){
-        for (int j=0; j<histSize[1]; j++){
-            if (histogram.at<double>(i,j)>0){
-                double xarr[] = {dim1start+i*dim1step, dim2start+j*dim2step, histogram.at<double>(i,j)};
-                Mat x(1,3,CV_64F, xarr);
-                samples.push_back(x);
+    if (fitHistogram(histogram, histSize, c1range, c2range, maxIter, minStepIncrease)){
+        makeLookup(histSize,c1range,c2range);
+    }
+}
+
+bool GaussianMixtureModel::fitHistogram(const Mat histogram, int histSize[2], float c1range[2], float c2range[2], int maxIter, double minStepIncrease){
+    if (dimensions!=2){
+        return false;
+    }
+    std::vector<float> xs, ys, ws;
+    histogramSamples2D(histogram, histSize, c1range, c2range, xs, ys, ws);
+    if (!fitSamples2D(xs, ys, ws, maxIter, minStepIncrease)){
+        return false;
+    }
+    initialized = true;
+    return true;
+}
+
+void GaussianMixtureModel::writeBinary(std::ostream& out) const{
+    int dims = initialized ? dimensions : 0;
+    int K = initialized ? components : 0;
+    writeValue(out, dims);
+    writeValue(out, K);
+    for (int k=0; k<K; k++){
+        writeValue(out, weight[k]);
+    }
+    for (int k=0; k<K; k++){
+        for (int i=0; i<dims; i++){
+            writeValue(out, meanVector[k].at<double>(i,0));
+        }
+    }
+    for (int k=0; k<K; k++){
+        for (int i=0; i<dims; i++){
+            for (int j=0; j<dims; j++){
+                writeValue(out, covarianceMatrix[k].at<double>(i,j));
             }
         }
     }
-    runExpectationMaximization(samples, maxIter, minStepIncrease);
-    makeLookup(histSize,c1range,c2range);
+}
+
+bool GaussianMixtureModel::readBinary(const char*& data, const char* end){
+    const char* pos = data;
+    int dims = 0;
+    int K = 0;
+    if (!readValue(pos, end, dims) || !readValue(pos, end, K) || dims<0 || K<0 || dims>maxStoredDimensions || K>maxStoredComponents){
+        return false;
+    }
+    if (K==0){
+        *this = GaussianMixtureModel();
+        data = pos;
+        return true;
+    }
+
+    size_t paramBytes = (size_t)K*(1+(size_t)dims+(size_t)dims*dims)*sizeof(double);
+    if (dims==0 || end-pos < (ptrdiff_t)paramBytes){
+        return false;
+    }
+    GaussianMixtureModel stored(dims, K);
+    for (int k=0; k<K; k++){
+        readValue(pos, end, stored.weight[k]);
+    }
+    for (int k=0; k<K; k++){
+        for (int i=0; i<dims; i++){
+            readValue(pos, end, stored.meanVector[k].at<double>(i,0));
+        }
+    }
+    for (int k=0; k<K; k++){
+        for (int i=0; i<dims; i++){
+            for (int j=0; j<dims; j++){
+                readValue(pos, end, stored.covarianceMatrix[k].at<double>(i,j));
+            }
+        }
+    }
+    stored.initialized = true;
+    *this = stored;
+    data = pos;
+    return true;
 }
 
 ColorHistBackProject::ColorHistBackProject(){
     name = "ColorHistBackProject";
+    preprocessMode = PREPROCESS_BILATERAL;
     int histSize[2];
     int channels[2];
     float c1range[2];
@@ -399,12 +1652,14 @@ ColorHistBackProject::ColorHistBackProject(){
     
     Histogram histTemp = Histogram(channels, histSize, c1range, c2range);
     objHistogram = histTemp;
+    binIndexer = BinIndexer::create(channels, histSize, c1range, c2range);
     
     initialized=false;
 }
 
 ColorHistBackProject::ColorHistBackProject(int code, const int* histogramSize){
     name = "ColorHistBackProject";
+    preprocessMode = PREPROCESS_BILATERAL;
     int channels[2];
     float c1range[2];
     float c2range[2];
@@ -429,11 +1684,13 @@ ColorHistBackProject::ColorHistBackProject(int code, const int* histogramSize){
 
     Histogram histTemp(channels, histSize, c1range, c2range);
     objHistogram = histTemp;
+    binIndexer = BinIndexer::create(channels, histSize, c1range, c2range);
     initialized=false;
 }
 
 ColorHistBackProject::ColorHistBackProject(int code, const int* histogramSize, String filename){
     name = "ColorHistBackProject";
+    preprocessMode = PREPROCESS_BILATERAL;
     int histSize[2];
     int channels[2];
     float c1range[2];
@@ -456,17 +1713,68 @@ ColorHistBackProject::ColorHistBackProject(int code, const int* histogramSize, S
 
     Histogram histTemp = Histogram(channels, histSize, c1range, c2range);
     objHistogram = histTemp;
+    binIndexer = BinIndexer::create(channels, histSize, c1range, c2range);
     Mat img = imread(filename);
 
     histFromImage(img);
     initialized=true;
 }
 
-void ColorHistBackProject::preprocess(const Mat image, Mat* outputImage){
-    //GaussianBlur(image, *outputImage, Size(15,15),0);
-    //medianBlur(image, *outputImage, 7);
+/* edge preserving smoothing of every channel guided by itself (He et al., Guided Image Filtering),
+   built from box filters so the cost does not depend on the radius*/
+static void guidedFilter(const Mat image, Mat& outputImage, int radius, double eps){
+    Size window(2*radius+1, 2*radius+1);
+    vector<Mat> planes;
+    split(image, planes);
+    for (size_t i=0; i<planes.size(); i++){
+        Mat p, mean, sqMean, a, b;
+        planes[i].convertTo(p, CV_32F);
+        boxFilter(p, mean, CV_32F, window);
+        boxFilter(p.mul(p), sqMean, CV_32F, window);
+        //a = var/(var+eps), b = mean*(1-a)
+        a = sqMean - mean.mul(mean);
+        divide(a, a+eps, a);
+        b = mean - a.mul(mean);
+        boxFilter(a, a, CV_32F, window);
+        boxFilter(b, b, CV_32F, window);
+        p = a.mul(p) + b;
+        p.convertTo(planes[i], image.depth());
+    }
+    merge(planes, outputImage);
+}
+
+bool parsePreprocessMode(const std::string name, PreprocessMode& mode){
+    static const char* names[] = {"none", "box", "gaussian", "bilateral-downsampled", "guided", "bilateral"};
+    static const PreprocessMode modes[] = {PREPROCESS_NONE, PREPROCESS_BOX, PREPROCESS_GAUSSIAN,
+                                           PREPROCESS_BILATERAL_DOWNSAMPLED, PREPROCESS_GUIDED, PREPROCESS_BILATERAL};
+    for (int i=0; i<6; i++){
+        if (name==names[i]){
+            mode = modes[i];
+            return true;
+        }
+    }
+    return false;
+}
 
-    bilateralFilter(image, *outputImage, 5, 75, 60);
+void ColorHistBackProject::preprocess(const Mat image, Mat* outputImage){
+    Mat small;
+    switch (preprocessMode){
+    case PREPROCESS_NONE:
+        image.copyTo(*outputImage); break;
+    case PREPROCESS_BOX:
+        blur(image, *outputImage, Size(5,5)); break;
+    case PREPROCESS_GAUSSIAN:
+        GaussianBlur(image, *outputImage, Size(5,5), 0); break;
+    case PREPROCESS_BILATERAL_DOWNSAMPLED:
+        pyrDown(image, small);
+        bilateralFilter(small, *outputImage, 3, 75, 60);
+        resize(*outputImage, *outputImage, image.size(), 0, 0, INTER_LINEAR); break;
+    case PREPROCESS_GUIDED:
+        guidedFilter(image, *outputImage, 2, 650); break;
+    case PREPROCESS_BILATERAL:
+    default:
+        bilateralFilter(image, *outputImage, 5, 75, 60); break;
+    }
     cvtColor(*outputImage, *outputImage, colorspaceCode);
 
     Mat temp;
@@ -517,8 +1825,18 @@ void ColorHistBackProject::updateHistogram(const Mat image, const Mat mask){
 
 void ColorHistBackProject::process(const Mat inputImage, Mat* outputImage){
     Mat cvtImage;
+    Mat binImage;
     preprocess(inputImage, &cvtImage);
-    objHistogram.backPropagate(cvtImage, outputImage);
+    std::vector<const Histogram*> histograms(1, &objHistogram);
+    std::vector<Mat> outputs;
+    if (binIndexer.empty()){
+        Histogram::backPropagate(cvtImage, histograms, outputs);
+    }
+    else {
+        binIndexer->binIndices(cvtImage, binImage);
+        Histogram::backPropagateBins(binImage, histograms, outputs);
+    }
+    *outputImage = outputs[0];
 }
 
 
@@ -526,29 +1844,8 @@ void ColorHistBackProject::process(const Mat inputImage, Mat* outputImage){
 
 void BayesColorHistBackProject::process(const Mat inputImage, Mat* outputImage){
     name = "BayesColorHistBackProject";
-    Mat cvtImage;
-    preprocess(inputImage, &cvtImage);
-
-    objHistogram.backPropagate(cvtImage, outputImage);
-    /*
-    Histogram imgHist = Histogram(objHistogram);
-    imgHist.fromImage(cvtImage);
-
-    Mat aprioriColor;
-    imgHist.backPropagate(cvtImage, &aprioriColor);
-
-    *outputImage = *outputImage/aprioriColor;
-
-    double histMax = 0;
-    double histMin = 0;
-    minMaxLoc(*outputImage, &histMin, &histMax, NULL, NULL);
-
-    outputImage->convertTo(*outputImage,CV_32F,1/(histMax-histMin),-histMin/(histMax-histMin));
-    */
-    outputImage->convertTo(*outputImage, CV_32F);
-    //aprioriColor.copyTo(*outputImage);
-
-    return;
+    //histFromImage replaces the object histogram with its GMM lookup, backprojecting it is the same as in the base class
+    ColorHistBackProject::process(inputImage, outputImage);
 }
 
 void BayesColorHistBackProject::histFromImage(const Mat image){
@@ -562,43 +1859,66 @@ void BayesColorHistBackProject::histFromImage(const Mat image){
 }
 
 
-GMMColorHistBackProject::GMMColorHistBackProject() : ColorHistBackProject(){
+GMMColorHistBackProject::GMMColorHistBackProject() : ColorHistBackProject(), aprioriReady(false), aprioriDecay(0.2){
     name = "GMMColorHistBackProject";
 }
 
-GMMColorHistBackProject::GMMColorHistBackProject(int code, const int* histogramSize) : ColorHistBackProject(code, histogramSize){
+GMMColorHistBackProject::GMMColorHistBackProject(int code, const int* histogramSize) : ColorHistBackProject(code, histogramSize), aprioriReady(false), aprioriDecay(0.2){
     name = "GMMColorHistBackProject";
 }
 
-GMMColorHistBackProject::GMMColorHistBackProject(int code, const int* histogramSize, String filename) : ColorHistBackProject(code, histogramSize,filename){
+GMMColorHistBackProject::GMMColorHistBackProject(int code, const int* histogramSize, String filename) : ColorHistBackProject(code, histogramSize,filename), aprioriReady(false), aprioriDecay(0.2){
     name = "GMMColorHistBackProject";
 }
 
 void GMMColorHistBackProject::process(const Mat inputImage, Mat* outputImage){
-    Mat cvtImage;
     preprocess(inputImage, &cvtImage);
 
-    objHistogram.backPropagate(cvtImage, outputImage);
-
-    Histogram imgHist = Histogram(objHistogram);
-    int size[2] = {16,16};
-    imgHist.resize(size);
-    imgHist.fromImage(cvtImage);
-
-    medianBlur(*outputImage, *outputImage, 5);
-    Mat aprioriColor;
-    imgHist.backPropagate(cvtImage, &aprioriColor);
-    medianBlur(aprioriColor, aprioriColor, 5);
-    *outputImage = *outputImage/aprioriColor;
-    double histMax = 0;
-    double histMin = 0;
-    minMaxLoc(*outputImage, &histMin, &histMax, NULL, NULL);
-    outputImage->convertTo(*outputImage,CV_32F,1/(histMax-histMin),-histMin/(histMax-histMin));
-
+    if (!aprioriReady){
+        int size[2] = {16,16};
+        aprioriHistogram = objHistogram;
+        aprioriHistogram.resize(size);
+        aprioriHistogram.fromImage(cvtImage);
+        ratioHistogram = objHistogram;
+        aprioriReady = true;
+    }
+    else {
+        aprioriHistogram.update(cvtImage, aprioriDecay);
+    }
 
+    //object to apriori probability ratio for every object histogram bin. Backpropagating it replaces backpropagating
+    //both histograms and dividing the images, bins the apriori histogram has never seen get 0.
+    const Mat& object = objHistogram.normalized;
+    const Mat& apriori = aprioriHistogram.normalized;
+    Mat& ratio = ratioHistogram.normalized;
+    ratio.create(object.size(), CV_32F);
+    for (int i=0; i<object.rows; i++){
+        const float* objRow = object.ptr<float>(i);
+        const float* aprioriRow = apriori.ptr<float>((2*i+1)*apriori.rows/(2*object.rows));
+        float* ratioRow = ratio.ptr<float>(i);
+        for (int j=0; j<object.cols; j++){
+            float aprioriValue = aprioriRow[(2*j+1)*apriori.cols/(2*object.cols)];
+            ratioRow[j] = aprioriValue>0 ? objRow[j]/aprioriValue : 0;
+        }
+    }
 
-    //outputImage->convertTo(*outputImage, CV_32FC1);
-    //outputImage->convertTo(*outputImage, CV_64F);
+    std::vector<const Histogram*> histograms(1, &ratioHistogram);
+    std::vector<Mat> outputs;
+    if (binIndexer.empty()){
+        Histogram::backPropagate(cvtImage, histograms, outputs);
+    }
+    else {
+        binIndexer->binIndices(cvtImage, binImage);
+        Histogram::backPropagateBins(binImage, histograms, outputs);
+    }
+    medianBlur(outputs[0], *outputImage, 5);
+
+    //rescaled to 0-1 over the pixels of this frame, as before the ratio table was introduced
+    double ratioMin = 0;
+    double ratioMax = 0;
+    minMaxLoc(*outputImage, &ratioMin, &ratioMax, NULL, NULL);
+    double ratioScale = ratioMax>ratioMin ? 1/(ratioMax-ratioMin) : 0;
+    outputImage->convertTo(*outputImage, CV_32F, ratioScale, -ratioMin*ratioScale);
 }
 
 void GMMColorHistBackProject::histFromImage(const Mat image){
@@ -1,6 +1,7 @@
 #include "NAOObjectGesture.h"
 #include <iostream>
 #include <fstream>
+#include <deque>
 
 #include <opencv2/highgui/highgui.hpp>
 
@@ -16,6 +17,7 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/thread.hpp>
 #include <boost/ref.hpp>
+#include <boost/bind.hpp>
 #include <boost/lambda/lambda.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/thread/pthread/condition_variable.hpp>
@@ -26,7 +28,6 @@
 #include "GestureRecognition.hpp"
 
 #define RESOLUTION AL::kQVGA
-#define COLORSPACE AL::kBGRColorSpace
 
 
 using namespace boost::filesystem;
@@ -42,9 +43,13 @@ struct NAOObjectGesture::Impl{
     Size imsize;
     int camIdx;
     int FPS;
+    /* if set, the camera is subscribed in YUV422 and the tracker works directly on its chroma, otherwise in BGR.
+       Set with the chromaOnly tracker option, which takes effect when the tracker is next started */
+    bool yuv422;
 
     boost::shared_ptr<AL::ALMotionProxy> motionProxy;
     int focusObjectId;
+    int focusKindHandle;
 
     boost::shared_ptr<ObjectTracker> objectTracker;
     boost::mutex objTrackerLock;
@@ -52,6 +57,13 @@ struct NAOObjectGesture::Impl{
 
     boost::mutex fileLock;
 
+    /* datasets are built one at a time on a single builder thread, in the order loadDataset was called */
+    boost::thread *builder;
+    std::deque<std::pair<int, std::string> > buildQueue;
+    boost::mutex buildQueueLock;
+    boost::condition_variable buildQueueCond;
+    bool stopBuilder;
+
     boost::posix_time::time_duration samplingPeriod;
     boost::thread *t;
     bool stopThread;
@@ -60,7 +72,8 @@ struct NAOObjectGesture::Impl{
 
 
     Impl(NAOObjectGesture& mod)
-        : module(mod), t(NULL), FPS(20), samplingPeriod(boost::posix_time::milliseconds(50)), focusObjectId(0)
+        : module(mod), t(NULL), FPS(20), yuv422(false), samplingPeriod(boost::posix_time::milliseconds(50)), focusObjectId(0), focusKindHandle(-1),
+          builder(NULL), stopBuilder(false)
     {
         try{
             objectTracker = boost::shared_ptr<ObjectTracker>(new ObjectTracker());
@@ -82,6 +95,7 @@ struct NAOObjectGesture::Impl{
             qiLogError("NAOObjectGesture") << "Failed to get a proxy to ALVideoDevice" << std::endl;
             throw std::runtime_error("Failed to get a proxy to ALVideoDevice");
         }
+        builder = new boost::thread(boost::bind(&NAOObjectGesture::Impl::runBuilder, this));
     }
 
     ~Impl(){
@@ -91,6 +105,105 @@ struct NAOObjectGesture::Impl{
         if (t){
             t->join();
         }
+        buildQueueLock.lock();
+        stopBuilder = true;
+        buildQueueLock.unlock();
+        buildQueueCond.notify_one();
+        if (builder){
+            builder->join();
+            delete builder;
+        }
+    }
+
+    /* Builder thread. Takes queued datasets in order and builds each into the kind slot reserved for it; a dataset queued
+       before shutdown is still built before the thread exits. */
+    void runBuilder(){
+        while (true){
+            std::pair<int, std::string> job;
+            {
+                boost::mutex::scoped_lock queueLock(buildQueueLock);
+                while (buildQueue.empty() && !stopBuilder){
+                    buildQueueCond.wait(queueLock);
+                }
+                if (buildQueue.empty()){
+                    return;
+                }
+                job = buildQueue.front();
+                buildQueue.pop_front();
+            }
+            if (!buildObjectKind(job.first, job.second)){
+                qiLogError("NAOObjectGesture") << "Object kind of " << job.second << " stays empty until it is removed" << std::endl;
+            }
+        }
+    }
+
+    /* Swaps a finished model into the kind slot reserved under handle */
+    void publishObjectKind(int handle, boost::shared_ptr<UpdatableHistogram> kind){
+        objTrackerLock.lock();
+        if (!objectTracker->publishObjectKind(handle, kind)){
+            qiLogInfo("NAOObjectGesture") << "Object kind was removed while its dataset was loading" << std::endl;
+        }
+        objTrackerLock.unlock();
+    }
+
+    /* Loads or fits the model of a new object kind on the builder thread. The tracker lock is only taken to publish
+       the finished model, so tracking keeps running while the model is fitted. Returns false if no model was built, in
+       which case the reserved slot is left without a model rather than removed, so the ids loadDataset has already
+       returned for later kinds keep pointing at them. */
+    bool buildObjectKind(int handle, const std::string dataFolder){
+        path rootDir(dataFolder);
+        if (!exists(rootDir) || !is_directory(rootDir)){
+            qiLogError("NAOObjectGesture") << "Failed to load dataset: Bad directory "<< dataFolder << std::endl;
+            return false;
+        }
+        boost::shared_ptr<UpdatableHistogram> kind = objectTracker->loadObjectKind(rootDir.string());
+        if (kind){
+            publishObjectKind(handle, kind);
+            qiLogInfo("NAOObjectGesture") << "Loaded stored model from " << dataFolder << std::endl;
+            return true;
+        }
+        path dataDir = rootDir / "Dataset";
+        path gTruthDir = rootDir / "GroundTruth";
+        vector<Mat> images;
+        vector<Mat> masks;
+        if (exists(dataDir) && exists(gTruthDir) && is_directory(dataDir) && is_directory(gTruthDir)){
+            try{
+                directory_iterator end_itr;
+                for(directory_iterator itr(dataDir); itr!=end_itr; ++itr){
+                    path filename = itr->path().stem();
+                    for(directory_iterator itr2(gTruthDir); itr2!=end_itr; ++itr2){
+                        path gTruthName = itr2->path().stem();
+                        if(filename==gTruthName){
+                            string impath = itr->path().string();
+                            string maskpath = itr2->path().string();
+                            Mat img(imread(impath));
+                            Mat mask(imread(maskpath,0));
+                            images.push_back(img);
+                            masks.push_back(mask);
+                        }
+                    }
+                }
+                kind = objectTracker->buildObjectKind(images, masks);
+                if (kind){
+                    kind->toStored(rootDir.string());
+                    publishObjectKind(handle, kind);
+                    qiLogInfo("NAOObjectGesture") << "Loaded " << images.size() << " images" << std::endl;
+                    const GaussianMixtureModel& model = kind->model();
+                    qiLogInfo("NAOObjectGesture") << "Color model with " << model.numComponents() << " components fitted in "
+                                                  << model.fitIterations << " EM iterations, log likelihood "
+                                                  << model.fitLogLikelihood << std::endl;
+                    return true;
+                }
+                else {
+                    qiLogError("NAOObjectGesture") << "Failed to load dataset" << std::endl;
+                }
+            } catch (std::exception &e){
+                qiLogError("NAOObjectGesture") << "Failed to load dataset images: " << e.what() << std::endl;
+            }
+        } else {
+            qiLogError("NAOObjectGesture") << "Failed to load dataset: Subdirectories missing"<< std::endl;
+        }
+        return false;
     }
 
     void operator()(){
@@ -100,7 +213,11 @@ struct NAOObjectGesture::Impl{
         stopThreadLock.lock();
         stopThreadCopy = stopThread;
         stopThreadLock.unlock();
-        camProxyName = camProxy->subscribeCamera("NAOObjectGesture", camIdx, RESOLUTION, COLORSPACE, FPS);/*
+        //the subscription's format is fixed, so changes of the option only apply to the next run
+        objTrackerLock.lock();
+        bool chromaOnly = yuv422;
+        objTrackerLock.unlock();
+        camProxyName = camProxy->subscribeCamera("NAOObjectGesture", camIdx, RESOLUTION, chromaOnly ? AL::kYUV422ColorSpace : AL::kBGRColorSpace, FPS);/*
         camProxy->setParam(3, 40);
         camProxy->setParam(11, 1);
         camProxy->setParam(22, 2);
@@ -122,8 +239,14 @@ struct NAOObjectGesture::Impl{
             Mat inputImage;
             try{
                 const AL::ALImage* img = (AL::ALImage*)camProxy->getImageLocal(camProxyName);
-                Mat imgHeader = Mat(imsize, CV_8UC3, (void*)img->getData());
-                imgHeader.copyTo(inputImage);
+                if (chromaOnly){
+                    Mat imgHeader = Mat(imsize, CV_8UC2, (void*)img->getData());
+                    yuv422Chroma(imgHeader, inputImage);
+                }
+                else {
+                    Mat imgHeader = Mat(imsize, CV_8UC3, (void*)img->getData());
+                    imgHeader.copyTo(inputImage);
+                }
                 camProxy->releaseImage(camProxyName);
             }
             catch (std::exception& e){
@@ -137,6 +260,9 @@ struct NAOObjectGesture::Impl{
             objectTracker->process(inputImage, &disregard);
 
 
+            if (focusObjectId<0){
+                focusObjectId = kindId(focusKindHandle);
+            }
             int tFocusObject = focusObjectId;
             if (focusObjectId<0 && (-focusObjectId)<= objectTracker->objectKinds.size()){
                 tFocusObject = objectTracker->largestObjOfKind[(-focusObjectId)-1];
@@ -185,9 +311,14 @@ struct NAOObjectGesture::Impl{
             //this is time since epoch in compatible values
 
             for (int j=0; j<events.size(); j++){
+                bool kindRemoved = false;
+                if (events[j].kindHandle>=0){
+                    events[j].objectId = kindId(events[j].kindHandle);
+                    kindRemoved = events[j].objectId==0;
+                }
                 int id = events[j].objectId;
                 bool trackingLargest = false;
-                if ((-id) > objectTracker->objectKinds.size()){
+                if (kindRemoved || (-id) > objectTracker->objectKinds.size()){
                     //if tracking nonexistent kind (simplified)
                     events[j].log(gestures);
                     memoryProxy->removeMicroEvent(events[j].name);
@@ -235,6 +366,15 @@ struct NAOObjectGesture::Impl{
             if (ticks==100){
                 ticks=0;
                 qiLogVerbose("NAOObjectGesture") << "Tracking working at " << 100000.0f/thousandFrameTime.total_milliseconds() << " FPS" << std::endl;
+                objTrackerLock.lock();
+                for (int i=0; i<objectTracker->objectKinds.size(); i++){
+                    if (!objectTracker->objectKinds.ready(i)){
+                        continue;
+                    }
+                    const AdaptationScheduler& sched = objectTracker->objectKinds[i].scheduler;
+                    qiLogVerbose("NAOObjectGesture") << "Object kind " << i << ": " << sched.performedUpdates << " histogram updates, " << sched.skippedUpdates << " skipped" << std::endl;
+                }
+                objTrackerLock.unlock();
                 thousandFrameTime = boost::posix_time::milliseconds(0);
             }
 
@@ -242,6 +382,13 @@ struct NAOObjectGesture::Impl{
         camProxy->unsubscribe(camProxyName);
     }
 
+    /* events and the head focus follow kinds by handle, so removing a kind renumbers the others without retargeting them.
+       Returns the current id of the kind, -(index+1), or 0 if it was removed. */
+    int kindId(int handle){
+        int index = objectTracker->objectKinds.indexOf(handle);
+        return index<0 ? 0 : -(index+1);
+    }
+
     vector<float> pt2headAngles(Point2i pt){
         float normx = 1.0f*pt.x/imsize.width;
         float normy = 1.0f*pt.y/imsize.height;
@@ -339,8 +486,9 @@ NAOObjectGesture::NAOObjectGesture(boost::shared_ptr<AL::ALBroker> pBroker, cons
     functionName("stopTracker", getName(), "Stop object tracker without deleting object kinds.");
     BIND_METHOD(NAOObjectGesture::stopTracker);
 
-    functionName("loadDataset", getName(), "Load image dataset from folder.");
+    functionName("loadDataset", getName(), "Load image dataset from folder in the background.");
     addParam("dataFolder", "Root folder containing Dataset and GroundTruth folders.");
+    setReturn("kindId", "Id of the new object kind. It can be tracked and focused right away and is detected once the dataset has loaded. If the dataset fails to load, the kind keeps its id but detects nothing until it is removed");
     BIND_METHOD(NAOObjectGesture::loadDataset);
 
     functionName("removeObjectKind", getName(), "Remove object kind specified by id");
@@ -399,6 +547,12 @@ NAOObjectGesture::NAOObjectGesture(boost::shared_ptr<AL::ALBroker> pBroker, cons
     functionName("stopFocus", getName(), "Stop tracking objects with head. Note: doesn't return head to neutral position");
     BIND_METHOD(NAOObjectGesture::stopFocus);
 
+    functionName("setTrackerOption", getName(), "Enable or disable an object tracker option. Supported options: quantizedProbability, onlineGMM, colorLookup, chromaOnly (applied when the tracker is next started)");
+    addParam("name", "Option name");
+    addParam("value", "True to enable the option, false to disable it");
+    setReturn("optionSet", "Boolean value. Returns true if the option exists, false otherwise");
+    BIND_METHOD(NAOObjectGesture::setTrackerOption);
+
 }
 
 NAOObjectGesture::~NAOObjectGesture(){}
@@ -454,69 +608,64 @@ void NAOObjectGesture::stopTracker(){
     }
 }
 
-void NAOObjectGesture::loadDataset(const std::string& dataFolder){
-    path rootDir(dataFolder);
+int NAOObjectGesture::loadDataset(const std::string& dataFolder){
     qiLogInfo("NAOObjectGesture") << "Attempting to load dataset in " << dataFolder << std::endl;
-    if (!exists(rootDir) || !is_directory(rootDir)){
-        qiLogError("NAOObjectGesture") << "Failed to load dataset: Bad directory "<< dataFolder << std::endl;
-    }
+    //the kind's slot is taken now, so its id is valid as soon as this returns and kinds keep the order they were requested in
     impl->objTrackerLock.lock();
-    bool cond = impl->objectTracker->addObjectKind(rootDir.string());
+    int handle = impl->objectTracker->reserveObjectKind();
+    int id = impl->kindId(handle);
     impl->objTrackerLock.unlock();
-    if (cond){
-        qiLogInfo("NAOObjectGesture") << "Loaded histogram from .png in " << dataFolder << std::endl;
-        return;
-    }
-    path dataDir = rootDir / "Dataset";
-    path gTruthDir = rootDir / "GroundTruth";
-    vector<Mat> images;
-    vector<Mat> masks;
-    if (exists(dataDir) && exists(gTruthDir) && is_directory(dataDir) && is_directory(gTruthDir)){
-        try{
-            directory_iterator end_itr;
-            for(directory_iterator itr(dataDir); itr!=end_itr; ++itr){
-                path filename = itr->path().stem();
-                for(directory_iterator itr2(gTruthDir); itr2!=end_itr; ++itr2){
-                    path gTruthName = itr2->path().stem();
-                    if(filename==gTruthName){
-                        string impath = itr->path().string();
-                        string maskpath = itr2->path().string();
-                        Mat img(imread(impath));
-                        Mat mask(imread(maskpath,0));
-                        images.push_back(img);
-                        masks.push_back(mask);
-                    }
-                }
-            }
-            impl->objTrackerLock.lock();
-            bool cond = impl->objectTracker->addObjectKind(images, masks, rootDir.string());
-            impl->objTrackerLock.unlock();
-            if (cond){
-                qiLogInfo("NAOObjectGesture") << "Loaded " << images.size() << " images" << std::endl;
-            }
-            else {
-                qiLogError("NAOObjectGesture") << "Failed to load dataset" << std::endl;
-            }
-        } catch (std::exception &e){
-            qiLogError("NAOObjectGesture") << "Failed to load dataset images: " << e.what() << std::endl;
-            exit();
-        }
-    } else {
-        qiLogError("NAOObjectGesture") << "Failed to load dataset: Subdirectories missing"<< std::endl;
-    }
+    impl->buildQueueLock.lock();
+    impl->buildQueue.push_back(std::make_pair(handle, dataFolder));
+    impl->buildQueueLock.unlock();
+    impl->buildQueueCond.notify_one();
+    return id;
 }
 
 void NAOObjectGesture::removeObjectKind(const int& id){
     impl->objTrackerLock.lock();
-    if (id>=impl->objectTracker->objectKinds.size()){
+    if (!impl->objectTracker->removeObjectKind(id)){
         qiLogError("NAOObjectGesture") << "Attempted to erase nonexistent object kind."<< std::endl;
     } else {
-        impl->objectTracker->objectKinds.erase(impl->objectTracker->objectKinds.begin()+id);
         qiLogInfo("NAOObjectGesture") << "Removed object kind " << id << std::endl;
     }
     impl->objTrackerLock.unlock();
 }
 
+bool NAOObjectGesture::setTrackerOption(const std::string &name, const bool &value){
+    impl->objTrackerLock.lock();
+    bool known = true;
+    if (name=="quantizedProbability"){
+        impl->objectTracker->quantizedProbability = value;
+    }
+    else if (name=="colorLookup"){
+        //only BGR frames are looked up directly, YUV422 chroma frames keep going through the bin indexer
+        impl->objectTracker->colorLookup = value;
+    }
+    else if (name=="chromaOnly"){
+        impl->yuv422 = value;
+    }
+    else if (name=="onlineGMM"){
+        //kinds copy the setting when they are published, so the ones already loaded are switched as well
+        impl->objectTracker->onlineGMM = value;
+        for (int i=0; i<impl->objectTracker->objectKinds.size(); i++){
+            if (impl->objectTracker->objectKinds.ready(i)){
+                impl->objectTracker->objectKinds[i].onlineGMM = value;
+            }
+        }
+    }
+    else {
+        known = false;
+    }
+    impl->objTrackerLock.unlock();
+    if (!known){
+        qiLogError("NAOObjectGesture") << "Unknown tracker option " << name << std::endl;
+        return false;
+    }
+    qiLogInfo("NAOObjectGesture") << "Tracker option " << name << " set to " << value << std::endl;
+    return true;
+}
+
 /**
 *   dataCode is any combination of:
 *   1: object timestamp
@@ -616,6 +765,9 @@ bool NAOObjectGesture::trackObject(const string &name, const int &objId){
         }
     }
     NAOEvent tEvent(name, objId, {0.3, 0.0},{1.0, -0.7});
+    if (objId<0){
+        tEvent.kindHandle = impl->objectTracker->objectKinds.handleOf((-objId)-1);
+    }
     impl->events.push_back(tEvent);
     impl->objTrackerLock.unlock();
     qiLogInfo("NAOObjectGesture") << "Now tracking object " << objId << " using event " << name << std::endl;
@@ -735,6 +887,7 @@ bool NAOObjectGesture::focusObject(const int &objId){
         }
     }
     impl->focusObjectId = objId;
+    impl->focusKindHandle = objId<0 ? impl->objectTracker->objectKinds.handleOf((-objId)-1) : -1;
     impl->objTrackerLock.unlock();
     qiLogInfo("NAOObjectGesture") << "Now focused on object " << objId << ". Tracking with NAO head." << std::endl;
     return true;
@@ -746,9 +899,9 @@ void NAOObjectGesture::stopFocus(){
     impl->objTrackerLock.unlock();
 }
 
-NAOEvent::NAOEvent(string tName, int tObjectId): name(tName), objectId(tObjectId), trajectory(Trajectory()){}
+NAOEvent::NAOEvent(string tName, int tObjectId): name(tName), objectId(tObjectId), kindHandle(-1), trajectory(Trajectory()){}
 
-NAOEvent::NAOEvent(string tName, int tObjectId, vector<float> num, vector<float> den) : name(tName), objectId(tObjectId), trajectory(Trajectory(num, den)){}
+NAOEvent::NAOEvent(string tName, int tObjectId, vector<float> num, vector<float> den) : name(tName), objectId(tObjectId), kindHandle(-1), trajectory(Trajectory(num, den)){}
 
 NAOEvent::~NAOEvent()
 {}
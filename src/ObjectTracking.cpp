@@ -7,10 +7,14 @@
 #include "boost/filesystem/fstream.hpp"
 #include "boost/date_time/posix_time/posix_time.hpp"
 #include <boost/thread/thread_time.hpp>
+#include "boost/thread.hpp"
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include "GestureRecognition.hpp"
 #include <cmath>
 #include <ctime>
 #include <cstdlib>
+#include <stdexcept>
 
 #ifdef TESTMODE
 #define VISUALDEBUG true
@@ -23,18 +27,47 @@ using namespace std;
 
 namespace fs = boost::filesystem;
 
-UpdatableHistogram::UpdatableHistogram(): Histogram(), buffersize(0){}
+UpdatableHistogram::UpdatableHistogram(): Histogram(), buffersize(0), bufferHead(0), bufferCount(0), bufferPushes(0), colorTableRevision(0), onlineGMM(false), gmmStepSize(0.1){}
 
 UpdatableHistogram::UpdatableHistogram(int channels[], int histogramSize[], float channel1range[], float channel2range[], int bufferSize):
     Histogram(channels, histogramSize, channel1range, channel2range),
-    buffersize(bufferSize)
+    buffersize(bufferSize),
+    bufferHead(0),
+    bufferCount(0),
+    bufferPushes(0),
+    colorTableRevision(0),
+    onlineGMM(false),
+    gmmStepSize(0.1)
 {}
 
 void UpdatableHistogram::update(Mat image, double alpha, const Mat mask){
-    const float* ranges[] = {c1range, c2range};
+    Mat binImage;
+    binIndices(image, binImage);
+    updateFromBins(binImage, alpha, mask, Mat());
+}
+
+void UpdatableHistogram::updateFromBins(const Mat binImage, double alpha, const Mat mask, const Mat frameHistogram){
     Mat colorHist;
-    calcHist(&image, 1, channels, mask, colorHist, 2, histSize, ranges, true, false);
+    calcFromBins(binImage, mask, colorHist);
+    adapt(binImage, colorHist, alpha, frameHistogram);
+}
+
+void UpdatableHistogram::updateFromBlobs(const Mat binImage, double alpha, const vector<vector<Point2i> >& blobs, const Mat frameHistogram){
+    int numBins = histSize[0]*histSize[1];
+    Mat colorHist = Mat::zeros(histSize[0], histSize[1], CV_32F);
+    float* hist = colorHist.ptr<float>(0);
+    for (int i=0; i<blobs.size(); i++){
+        for (int j=0; j<blobs[i].size(); j++){
+            ushort bin = binImage.at<ushort>(blobs[i][j]);
+            if (bin<numBins){
+                hist[bin] += 1.0f;
+            }
+        }
+    }
+    adapt(binImage, colorHist, alpha, frameHistogram);
+}
 
+void UpdatableHistogram::adapt(const Mat binImage, const Mat colorHist, double alpha, const Mat frameHistogram){
     double minVal = 0;
     double maxVal = 0;
     minMaxLoc(colorHist, &minVal, &maxVal);
@@ -43,37 +76,70 @@ void UpdatableHistogram::update(Mat image, double alpha, const Mat mask){
         return;
     }
 
-    Mat apriori;
-    calcHist(&image, 1, channels, Mat(), apriori, 2, histSize, ranges, true, false);
-
-    apriori.convertTo(apriori, CV_32F);
-    colorHist.convertTo(colorHist, CV_32F);
+    Mat apriori = frameHistogram;
+    if (apriori.empty()){
+        calcFromBins(binImage, Mat(), apriori);
+    }
 
     Mat aposteriori = colorHist/apriori;
 
+    //fixed capacity ring buffer with a running sum of its valid entries, so averaging costs the same for any buffer size
+    int capacity = max(buffersize, 1);
+    if (buffer.size()!=capacity || bufferSum.size()!=aposteriori.size()){
+        buffer.assign(capacity, Mat());
+        bufferValid.assign(capacity, false);
+        bufferSum = Mat::zeros(aposteriori.size(), CV_32F);
+        bufferHead = 0;
+        bufferCount = 0;
+        bufferPushes = 0;
+    }
+    if (bufferValid[bufferHead]){
+        bufferSum -= buffer[bufferHead];
+        bufferCount--;
+    }
+    minMaxLoc(aposteriori, &minVal, &maxVal);
+    buffer[bufferHead] = aposteriori;
+    bufferValid[bufferHead] = maxVal>1e-6;
+    if (bufferValid[bufferHead]){
+        bufferSum += aposteriori;
+        bufferCount++;
+    }
+    bufferHead = (bufferHead+1)%capacity;
+
+    //adding and subtracting accumulates rounding error, so the sum is rebuilt once per pass through the buffer
+    bufferPushes++;
+    if (bufferPushes>=capacity){
+        bufferPushes = 0;
+        bufferSum.setTo(Scalar(0));
+        for (int i=0; i<capacity; i++){
+            if (bufferValid[i]){
+                bufferSum += buffer[i];
+            }
+        }
+    }
 
-    if(buffer.size()>=buffersize){
-        buffer.erase(buffer.begin());
+    Mat average;
+    if (bufferCount>0){
+        average = bufferSum/bufferCount;
+    }
+    else {
+        average = aposteriori;
     }
-    buffer.push_back(aposteriori);
 
-    int full = 1;
-    for (int i=0; i<buffer.size()-1; i++){
-        minMaxLoc(buffer[i], &minVal, &maxVal);
-        if (maxVal>1e-6){
-            aposteriori+=buffer[i];
-            full++;
+    //in online GMM mode the averaged histogram refines the mixture model and its smooth lookup replaces the raw average
+    if (onlineGMM){
+        Mat smoothed;
+        if (updateGMM(average, gmmStepSize, smoothed)){
+            average = smoothed;
         }
     }
-    if (full>1){
-        aposteriori/=full;
-    }
 
-    aposteriori = alpha*offline + (1-alpha)*aposteriori;
-    aposteriori.copyTo(normalized);
+    average = alpha*offline + (1-alpha)*average;
+    average.copyTo(normalized);
+    quantize();
 }
 
-void UpdatableHistogram::fromImage(const vector<Mat> image, const vector<Mat> mask){
+void UpdatableHistogram::fromImage(const vector<Mat> image, const vector<Mat> mask, int threads){
     const float* ranges[] = {c1range, c2range};
     Mat aposteriori;
     Mat colorHist;
@@ -91,29 +157,49 @@ void UpdatableHistogram::fromImage(const vector<Mat> image, const vector<Mat> ma
     aposteriori.copyTo(offline);
     aposteriori.copyTo(normalized);
     aposteriori.copyTo(accumulator);
-    makeGMM(3,20,0.001);
+    if (!selectGMM(5,20,0.001,10,threads)){
+        throw std::runtime_error("No object pixels to fit a color model to");
+    }
     normalized.copyTo(offline);
 }
 
-void UpdatableHistogram::toImage(std::string rootPath){
+void UpdatableHistogram::toStored(std::string rootPath){
     boost::filesystem::path bPath(rootPath);
     boost::filesystem::create_directories(bPath);
-    bPath /= "histogram.png";
-    Mat tempMat;
-    offline.convertTo(tempMat, CV_8U, 255.0);
-    imwrite(bPath.string(), tempMat);
+    bPath /= "model.bin";
+    boost::filesystem::ofstream file(bPath, std::ios::out | std::ios::binary | std::ios::trunc);
+    writeBinary(file, offline);
 }
 
 bool UpdatableHistogram::fromStored(std::string rootPath){
+    boost::filesystem::path modelPath(rootPath);
+    modelPath /= "model.bin";
     boost::filesystem::path bPath(rootPath);
     bPath /= "histogram.png";
     try{
+        if (boost::filesystem::exists(modelPath)){
+            boost::interprocess::file_mapping file(modelPath.string().c_str(), boost::interprocess::read_only);
+            boost::interprocess::mapped_region region(file, boost::interprocess::read_only);
+            const char* data = static_cast<const char*>(region.get_address());
+            const char* end = data + region.get_size();
+            Mat model;
+            if (!readBinary(data, end, model)){
+                return false;
+            }
+            model.copyTo(offline);
+            model.copyTo(normalized);
+            model.copyTo(accumulator);
+            quantize();
+            return true;
+        }
+        //models stored by earlier versions as an 8-bit image, without the gaussian mixture model
         if (boost::filesystem::exists(bPath)){
             Mat tempMat;
             tempMat = imread(bPath.string(), CV_LOAD_IMAGE_GRAYSCALE);
             tempMat.convertTo(normalized, CV_32F, 1.0/255.0);
             normalized.copyTo(offline);
             normalized.copyTo(accumulator);
+            quantize();
             return true;
         }
     } catch (std::exception &e){
@@ -122,6 +208,130 @@ bool UpdatableHistogram::fromStored(std::string rootPath){
     return false;
 }
 
+const Mat& UpdatableHistogram::colorLookup(const Mat colorBins, bool quantizedTable){
+    int type = quantizedTable ? CV_8U : CV_32F;
+    if (!colorTable.empty() && colorTable.type()==type && colorTable.total()==colorBins.total() && colorTableRevision==revision()){
+        return colorTable;
+    }
+    const Mat& source = quantizedTable ? quantized : normalized;
+    int numBins = histSize[0]*histSize[1];
+    colorTable.create(1, colorBins.total(), type);
+    const ushort* bins = colorBins.ptr<ushort>(0);
+    for (int i=0; i<colorBins.total(); i++){
+        int bin = bins[i];
+        int row = bin/histSize[1];
+        int col = bin%histSize[1];
+        if (quantizedTable){
+            colorTable.at<uchar>(0,i) = bin<numBins ? source.at<uchar>(row,col) : 0;
+        }
+        else {
+            colorTable.at<float>(0,i) = bin<numBins ? source.at<float>(row,col) : 0;
+        }
+    }
+    colorTableRevision = revision();
+    return colorTable;
+}
+
+AdaptationScheduler::AdaptationScheduler(): driftThreshold(0.15), maxInterval(10), framesSinceUpdate(0), skippedUpdates(0), performedUpdates(0), referenceProbability(0), referenceArea(0), hasReference(false){}
+
+AdaptationScheduler::AdaptationScheduler(double threshold, int interval): driftThreshold(threshold), maxInterval(interval), framesSinceUpdate(0), skippedUpdates(0), performedUpdates(0), referenceProbability(0), referenceArea(0), hasReference(false){}
+
+bool AdaptationScheduler::shouldUpdate(double meanProbability, double area){
+    //nothing to adapt to, this is not counted as a skipped update
+    if (area<=0){
+        return false;
+    }
+    framesSinceUpdate++;
+    bool update = !hasReference || framesSinceUpdate>=maxInterval;
+    if (!update){
+        double probabilityDrift = abs(meanProbability-referenceProbability)/max(referenceProbability, 1e-6);
+        double areaDrift = abs(area-referenceArea)/max(referenceArea, 1.0);
+        update = probabilityDrift>driftThreshold || areaDrift>driftThreshold;
+    }
+    if (!update){
+        skippedUpdates++;
+        return false;
+    }
+    referenceProbability = meanProbability;
+    referenceArea = area;
+    hasReference = true;
+    framesSinceUpdate = 0;
+    performedUpdates++;
+    return true;
+}
+
+ObjectKindRegistry::ObjectKindRegistry(){
+    nextHandle = 0;
+}
+
+int ObjectKindRegistry::add(boost::shared_ptr<UpdatableHistogram> kind){
+    kinds.push_back(kind);
+    handles.push_back(nextHandle);
+    return nextHandle++;
+}
+
+int ObjectKindRegistry::reserve(){
+    return add(boost::shared_ptr<UpdatableHistogram>());
+}
+
+bool ObjectKindRegistry::publish(int handle, boost::shared_ptr<UpdatableHistogram> kind){
+    int index = indexOf(handle);
+    if (index<0){
+        return false;
+    }
+    kinds[index] = kind;
+    return true;
+}
+
+bool ObjectKindRegistry::ready(int index) const{
+    return index>=0 && index<kinds.size() && kinds[index];
+}
+
+bool ObjectKindRegistry::remove(int index){
+    if (index<0 || index>=kinds.size()){
+        return false;
+    }
+    kinds.erase(kinds.begin()+index);
+    handles.erase(handles.begin()+index);
+    return true;
+}
+
+int ObjectKindRegistry::indexOf(int handle) const{
+    for (int i=0; i<handles.size(); i++){
+        if (handles[i]==handle){
+            return i;
+        }
+    }
+    return -1;
+}
+
+int ObjectKindRegistry::handleOf(int index) const{
+    if (index<0 || index>=handles.size()){
+        return -1;
+    }
+    return handles[index];
+}
+
+boost::shared_ptr<UpdatableHistogram> ObjectKindRegistry::get(int index) const{
+    return kinds[index];
+}
+
+UpdatableHistogram& ObjectKindRegistry::operator[](int index){
+    return *kinds[index];
+}
+
+const UpdatableHistogram& ObjectKindRegistry::operator[](int index) const{
+    return *kinds[index];
+}
+
+UpdatableHistogram& ObjectKindRegistry::back(){
+    return *kinds.back();
+}
+
+size_t ObjectKindRegistry::size() const{
+    return kinds.size();
+}
+
 TrackedObject::TrackedObject(){
     tracked = false;
 }
@@ -323,68 +533,129 @@ ObjectTracker::ObjectTracker(){
     initialized = true;
     frameNumber = 0;
     nextObjectIdx = 1;
+    quantizedProbability = false;
+    histBufferSize = 5;
+    onlineGMM = false;
+    colorLookup = false;
+    modelThreads = 0;
+    histChannels[0] = 0; histChannels[1] = 1;
+    histSize[0] = 64; histSize[1] = 64;
+    c1range[0] = 0; c1range[1] = 256;
+    c2range[0] = 0; c2range[1] = 256;
+    binIndexer = BinIndexer::create(histChannels, histSize, c1range, c2range);
+
+    //histogram bin of the center color of every cell of the quantized BGR space, shared by the tables of all kinds
+    const int bits = colorLookupBits;
+    const int levels = 1<<bits;
+    const int shift = 8-bits;
+    Mat cellColors(levels*levels, levels, CV_8UC3);
+    for (int i=0; i<levels*levels*levels; i++){
+        Vec3b& color = cellColors.at<Vec3b>(i/levels, i%levels);
+        color[0] = ((i>>(2*bits))<<shift) | (1<<(shift-1));
+        color[1] = (((i>>bits)&(levels-1))<<shift) | (1<<(shift-1));
+        color[2] = ((i&(levels-1))<<shift) | (1<<(shift-1));
+    }
+    cvtColor(cellColors, cellColors, CV_BGR2YCrCb);
+    Mat cellChroma(cellColors.size(), CV_8UC2);
+    int fromTo[] = {1,0, 2,1};
+    mixChannels(&cellColors, 1, &cellChroma, 1, fromTo, 2);
+    binIndexer->binIndices(cellChroma, colorBins);
 }
 
-void ObjectTracker::preprocess(const Mat image, Mat& outputImage, Mat& mask){
+void ObjectTracker::binFrame(const Mat image, Mat& binImage){
+    //the fused kernel gives the same bins as preprocess without writing the blurred and converted images
+    if (image.type()!=CV_8UC3 || histSize[0]!=histSize[1] || !blurYCrCbBins(image, histSize[0], binImage)){
+        Mat procimg;
+        preprocess(image, procimg, binImage);
+    }
+}
+
+void ObjectTracker::preprocess(const Mat image, Mat& outputImage, Mat& binImage){
+    //Cr/Cb images, such as the chroma of YUV422 cameras, are already in the color space the histograms use
+    if (image.type()==CV_8UC2){
+        blur(image, outputImage, Size(5,5));
+        binIndexer->binIndices(outputImage, binImage);
+        return;
+    }
     Mat procimg;
     blur(image, procimg, Size(5,5));
     cvtColor(procimg, procimg, CV_BGR2YCrCb);
-    //Scalar lowRange = Scalar(40,0,0);
-    //Scalar highRange = Scalar(215,255,255);
-    //inRange(procimg, lowRange, highRange, mask);
-    mask = Mat::ones(image.size(), CV_8U)*255;
-    procimg.convertTo(outputImage, CV_32F);
+    //only the chroma channels are used, so they are kept as a two channel 8-bit Cr/Cb image
+    outputImage.create(procimg.size(), CV_8UC2);
+    int fromTo[] = {1,0, 2,1};
+    mixChannels(&procimg, 1, &outputImage, 1, fromTo, 2);
+    binIndexer->binIndices(outputImage, binImage);
 }
 
-bool ObjectTracker::addObjectKind(const vector<Mat> image, const vector<Mat> outMask){
+boost::shared_ptr<UpdatableHistogram> ObjectTracker::buildObjectKind(const vector<Mat> image, const vector<Mat> outMask){
+    boost::shared_ptr<UpdatableHistogram> objHist;
     try{
         vector<Mat> procimg;
         vector<Mat> mask;
         int numImg = min(image.size(), outMask.size());
         for(int i=0; i<numImg; i++){
             Mat temp;
-            Mat tempmask;
-            preprocess(image[i], temp, tempmask);
-            bitwise_and(tempmask, outMask[i], tempmask);
+            Mat tempbins;
+            preprocess(image[i], temp, tempbins);
             procimg.push_back(temp);
-            mask.push_back(tempmask);
+            mask.push_back(outMask[i]);
         }
-        int channels[2] = {1,2};
-        float c1range[2] = {0,256};
-        float c2range[2] = {0,256};
-
-        int histSize[2] = {64,64};
-        UpdatableHistogram objHist(channels, histSize, c1range, c2range, 5);
-        objHist.fromImage(procimg, mask);
-        objectKinds.push_back(objHist);
-        largestObjOfKind.push_back(0);
+        objHist.reset(new UpdatableHistogram(histChannels, histSize, c1range, c2range, histBufferSize));
+        //a kind is usually built while frames are tracked, so one core is left to the tracker unless a budget is set
+        int threads = modelThreads>0 ? modelThreads : std::max(1, (int)boost::thread::hardware_concurrency()-1);
+        objHist->fromImage(procimg, mask, threads);
     } catch (std::exception &e){
+        objHist.reset();
+    }
+    return objHist;
+}
+
+boost::shared_ptr<UpdatableHistogram> ObjectTracker::loadObjectKind(std::string path){
+    boost::shared_ptr<UpdatableHistogram> objHist(new UpdatableHistogram(histChannels, histSize, c1range, c2range, histBufferSize));
+    if (!objHist->fromStored(path)){
+        objHist.reset();
+    }
+    return objHist;
+}
+
+void ObjectTracker::adoptObjectKind(boost::shared_ptr<UpdatableHistogram> kind){
+    kind->onlineGMM = onlineGMM;
+    objectKinds.add(kind);
+    largestObjOfKind.push_back(0);
+}
+
+int ObjectTracker::reserveObjectKind(){
+    largestObjOfKind.push_back(0);
+    return objectKinds.reserve();
+}
+
+bool ObjectTracker::publishObjectKind(int handle, boost::shared_ptr<UpdatableHistogram> kind){
+    kind->onlineGMM = onlineGMM;
+    return objectKinds.publish(handle, kind);
+}
+
+bool ObjectTracker::addObjectKind(const vector<Mat> image, const vector<Mat> outMask){
+    boost::shared_ptr<UpdatableHistogram> objHist = buildObjectKind(image, outMask);
+    if (!objHist){
         return false;
     }
+    adoptObjectKind(objHist);
     return true;
 }
 
 bool ObjectTracker::addObjectKind(std::string path){
-    int channels[2] = {1,2};
-    float c1range[2] = {0,256};
-    float c2range[2] = {0,256};
-    int histSize[2] = {64,64};
-    UpdatableHistogram objHist(channels, histSize, c1range, c2range, 5);
-    bool cond = objHist.fromStored(path);
-    if (cond){
-        objectKinds.push_back(objHist);
-        largestObjOfKind.push_back(0);
-        return true;
-    }
-    else{
+    boost::shared_ptr<UpdatableHistogram> objHist = loadObjectKind(path);
+    if (!objHist){
         return false;
     }
+    adoptObjectKind(objHist);
+    return true;
 }
 
 bool ObjectTracker::addObjectKind(const vector<Mat> image, const vector<Mat> outMask, std::string path){
     if (!this->addObjectKind(path)){
         if(this->addObjectKind(image, outMask)){
-            objectKinds.back().toImage(path);
+            objectKinds.back().toStored(path);
             return true;
         }
         else {
@@ -397,19 +668,116 @@ bool ObjectTracker::addObjectKind(const vector<Mat> image, const vector<Mat> out
 }
 
 
-void ObjectTracker::getProbImages(const Mat procimg, const Mat mask, vector<Mat> &outputImages){
-    //first, get the general image histogram and use it to get a normalized probability image of the input image
-    double histMax = 0;
-    double histMin = 0;
-    outputImages.clear();
+bool ObjectTracker::removeObjectKind(int index){
+    if (!objectKinds.remove(index)){
+        return false;
+    }
+    largestObjOfKind.erase(largestObjOfKind.begin()+index);
+    //objects of the removed kind are dropped, later kinds move down one index
+    vector<int> deleteKeys;
+    for (objMap::iterator it=objects.begin(); it!=objects.end(); ++it){
+        if (it->second->kind == index){
+            deleteKeys.push_back(it->first);
+        }
+        else if (it->second->kind > index){
+            it->second->kind--;
+        }
+    }
+    for (int i=0; i<deleteKeys.size(); i++){
+        objects.erase(deleteKeys[i]);
+    }
+    return true;
+}
+
+
+void ObjectTracker::getProbImages(const Mat binImage, vector<Mat> &outputImages){
+    //all kinds share the same histogram geometry, so the frame is binned once in preprocess and looked up in each kind's histogram
+    vector<const Histogram*> kindHistograms;
+    vector<int> readyKinds;
     for (int i=0; i<objectKinds.size(); i++){
-        Mat objProb;
-        objectKinds[i].backPropagate(procimg, &objProb);
-        outputImages.push_back(objProb);
+        if (objectKinds.ready(i)){
+            kindHistograms.push_back(&objectKinds[i]);
+            readyKinds.push_back(i);
+        }
+    }
+    vector<Mat> readyImages;
+    if (quantizedProbability){
+        Histogram::backPropagateQuantized(binImage, kindHistograms, readyImages);
+    }
+    else {
+        Histogram::backPropagateBins(binImage, kindHistograms, readyImages);
+    }
+    //kinds whose model is still being built keep their index with an empty probability image
+    outputImages.assign(objectKinds.size(), Mat());
+    for (int i=0; i<readyKinds.size(); i++){
+        outputImages[readyKinds[i]] = readyImages[i];
+    }
+    for (int i=0; i<outputImages.size(); i++){
+        if (outputImages[i].empty()){
+            outputImages[i] = Mat::zeros(binImage.size(), quantizedProbability ? CV_8U : CV_32F);
+        }
     }
 }
 
 
+void ObjectTracker::lookupFrame(const Mat image, Mat& binImage, vector<Mat>& outputImages){
+    const int bits = colorLookupBits;
+    const int shift = 8-bits;
+    Mat blurred;
+    blur(image, blurred, Size(5,5));
+
+    vector<const Mat*> tables;
+    vector<Mat> readyImages;
+    outputImages.resize(objectKinds.size());
+    for (int k=0; k<objectKinds.size(); k++){
+        if (!objectKinds.ready(k)){
+            outputImages[k] = Mat::zeros(image.size(), quantizedProbability ? CV_8U : CV_32F);
+            continue;
+        }
+        tables.push_back(&objectKinds[k].colorLookup(colorBins, quantizedProbability));
+        outputImages[k].create(image.size(), quantizedProbability ? CV_8U : CV_32F);
+        readyImages.push_back(outputImages[k]);
+    }
+    binImage.create(image.size(), CV_16U);
+
+    const ushort* cellBins = colorBins.ptr<ushort>(0);
+    vector<int> cells(image.cols);
+    for (int y=0; y<image.rows; y++){
+        const uchar* row = blurred.ptr<uchar>(y);
+        ushort* bins = binImage.ptr<ushort>(y);
+        for (int x=0; x<image.cols; x++){
+            cells[x] = ((row[3*x]>>shift)<<(2*bits)) | ((row[3*x+1]>>shift)<<bits) | (row[3*x+2]>>shift);
+            bins[x] = cellBins[cells[x]];
+        }
+        for (int k=0; k<tables.size(); k++){
+            if (quantizedProbability){
+                const uchar* table = tables[k]->ptr<uchar>(0);
+                uchar* out = readyImages[k].ptr<uchar>(y);
+                for (int x=0; x<image.cols; x++){
+                    out[x] = table[cells[x]];
+                }
+            }
+            else {
+                const float* table = tables[k]->ptr<float>(0);
+                float* out = readyImages[k].ptr<float>(y);
+                for (int x=0; x<image.cols; x++){
+                    out[x] = table[cells[x]];
+                }
+            }
+        }
+    }
+}
+
+void ObjectTracker::probabilityImages(const Mat image, Mat& binImage, vector<Mat>& outputImages){
+    if (colorLookup && image.type()==CV_8UC3){
+        lookupFrame(image, binImage, outputImages);
+    }
+    else {
+        binFrame(image, binImage);
+        getProbImages(binImage, outputImages);
+    }
+}
+
 void ObjectTracker::process(const Mat inputImage, Mat* outputImage){
     double minimumAreaCutoff = inputImage.size().area()/225.0;
     double closeDistance = 20.0;
@@ -417,7 +785,12 @@ void ObjectTracker::process(const Mat inputImage, Mat* outputImage){
     double occludedHigh = 0.6;
     Mat drawImg;
     if (VISUALDEBUG){
-        inputImage.copyTo(drawImg);
+        if (inputImage.type()==CV_8UC2){
+            chromaToBGR(inputImage, drawImg);
+        }
+        else {
+            inputImage.copyTo(drawImg);
+        }
     }
 
     vector<Mat> probImages;
@@ -427,10 +800,11 @@ void ObjectTracker::process(const Mat inputImage, Mat* outputImage){
         Mat temp(Mat::zeros(inputImage.size(), CV_8U));
         temp.copyTo(binImg);
     }
-    Mat procimg;
-    Mat mask;
-    preprocess(inputImage, procimg, mask);
-    getProbImages(procimg, mask, probImages);
+    Mat binImage;
+    probabilityImages(inputImage, binImage, probImages);
+
+    //the apriori color histogram of the frame is the same for every kind, and only computed once a kind adapts
+    Mat frameHistogram;
 
     vector<vector<Point2i>> blobs;
     vector<int> blobKinds;
@@ -439,7 +813,30 @@ void ObjectTracker::process(const Mat inputImage, Mat* outputImage){
         Mat temp;
         vector<vector<Point2i>> tempBlobs;
         hysteresisThreshold(probImages[i], temp, tempBlobs, 0.3, 0.7);
-        objectKinds[i].update(procimg, 0.3, temp);
+
+        //cheap drift statistics decide whether the kind's histogram needs adapting this frame
+        double blobArea = 0;
+        double blobProbability = 0;
+        for (int j=0; j<tempBlobs.size(); j++){
+            blobArea += tempBlobs[j].size();
+            for (int k=0; k<tempBlobs[j].size(); k++){
+                if (probImages[i].depth()==CV_8U){
+                    blobProbability += probImages[i].at<uchar>(tempBlobs[j][k])/255.0;
+                }
+                else {
+                    blobProbability += probImages[i].at<float>(tempBlobs[j][k]);
+                }
+            }
+        }
+        if (blobArea>0){
+            blobProbability /= blobArea;
+        }
+        if (objectKinds.ready(i) && objectKinds[i].scheduler.shouldUpdate(blobProbability, blobArea)){
+            if (frameHistogram.empty()){
+                Histogram::calcFromBins(binImage, Mat(), histSize, frameHistogram);
+            }
+            objectKinds[i].updateFromBlobs(binImage, 0.3, tempBlobs, frameHistogram);
+        }
         for (int j=0; j<tempBlobs.size(); j++){
             blobs.push_back(tempBlobs[j]);
             blobKinds.push_back(i);
@@ -605,7 +1002,7 @@ void ObjectTracker::process(const Mat inputImage, Mat* outputImage){
     }
 
     for (int i=0; i<newBlobs.size(); i++){
-        boost::shared_ptr<TrackedObject> temp(new TrackedObject(procimg, blobs[newBlobs[i]]));
+        boost::shared_ptr<TrackedObject> temp(new TrackedObject(binImage, blobs[newBlobs[i]]));
         temp->kind = blobKinds[newBlobs[i]];
         int id = nextObjectIdx++;
         temp->id = id;
@@ -805,7 +1202,53 @@ double distEllipse2Point(RotatedRect ellipse, Point2f pt){
     return distsq;
 }
 
+/* hysteresis thresholding of 8-bit probability images. Regions are grown directly into the output image
+   instead of a labelled copy of the input, since labels do not fit into 8 bits */
+static void hysteresisThreshold8U(const cv::Mat inputImg, cv::Mat& binary, std::vector < std::vector<cv::Point2i> > &blobs, int lowThresh, int hiThresh){
+    Mat temp(Mat::zeros(inputImg.size(), CV_8UC1));
+    blobs.clear();
+    vector<Point2i> stack;
+    for(int y=0; y < inputImg.rows; y++) {
+        const uchar *row = inputImg.ptr<uchar>(y);
+        const uchar *visited = temp.ptr<uchar>(y);
+        for(int x=0; x < inputImg.cols; x++) {
+            if(visited[x] || row[x] < hiThresh) {
+                continue;
+            }
+
+            vector<Point2i> blob;
+            stack.push_back(Point2i(x,y));
+            temp.at<uchar>(y,x) = 255;
+            while (!stack.empty()){
+                Point2i pt = stack.back();
+                stack.pop_back();
+                blob.push_back(pt);
+                Point2i neighbours[4] = {Point2i(pt.x-1,pt.y), Point2i(pt.x+1,pt.y), Point2i(pt.x,pt.y-1), Point2i(pt.x,pt.y+1)};
+                for (int i=0; i<4; i++){
+                    Point2i nb = neighbours[i];
+                    if (nb.x<0 || nb.y<0 || nb.x>=inputImg.cols || nb.y>=inputImg.rows){
+                        continue;
+                    }
+                    uchar& mark = temp.at<uchar>(nb);
+                    if (!mark && inputImg.at<uchar>(nb)>=lowThresh){
+                        mark = 255;
+                        stack.push_back(nb);
+                    }
+                }
+            }
+            blobs.push_back(blob);
+        }
+    }
+
+    temp.copyTo(binary);
+}
+
 void hysteresisThreshold(const cv::Mat inputImg, cv::Mat& binary, std::vector < std::vector<cv::Point2i> > &blobs, double lowThresh, double hiThresh){
+    if (inputImg.type()==CV_8UC1){
+        hysteresisThreshold8U(inputImg, binary, blobs, cvRound(lowThresh*255), cvRound(hiThresh*255));
+        return;
+    }
+
     int label_count = 2;
 
     Mat probImg;
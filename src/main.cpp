@@ -36,6 +36,11 @@ int main(void)
     ImageAcquisition* capture;
     std::string rDir = "";
     std::string imgseq = "";
+    bool quantizedProbability = false;
+    bool onlineGMM = false;
+    bool colorLookup = false;
+    int modelThreads = 0;
+    PreprocessMode preprocessMode = PREPROCESS_BILATERAL;
     if (!exists(iniPath)){
         ConnectedCamera* camera = new ConnectedCamera(0);
         capture = camera;
@@ -44,6 +49,14 @@ int main(void)
         boost::property_tree::ptree pt;
         boost::property_tree::ini_parser::read_ini(iniPath.string(), pt);
         rDir = pt.get<string>("Local.ImageDirectory", "");
+        quantizedProbability = pt.get<int>("Tracker.QuantizedProbability", 0)!=0;
+        onlineGMM = pt.get<int>("Tracker.OnlineGMM", 0)!=0;
+        colorLookup = pt.get<int>("Tracker.ColorLookup", 0)!=0;
+        modelThreads = pt.get<int>("Tracker.ModelThreads", 0);
+        std::string modeName = pt.get<string>("Local.PreprocessMode", "bilateral");
+        if (!parsePreprocessMode(modeName, preprocessMode)){
+            std::cout << "Unknown preprocessing mode " << modeName << ", using bilateral" << std::endl;
+        }
         int localCam = pt.get<int>("Local.UseLocalCamera", 0);
         if (localCam){
             int camid = pt.get<int>("Local.Camera", -1);
@@ -68,8 +81,9 @@ int main(void)
             else {
                 std::string ip = pt.get<string>("Remote.IP", "");
                 int port = pt.get<int>("Remote.PORT", 0);
+                int yuv422 = pt.get<int>("Remote.UseYUV422", 0);
                 std::cout << "Connecting to NAO at " << ip << ":" << port <<  std::endl;
-                NAOCamera* camera = new NAOCamera(ip, port);
+                NAOCamera* camera = new NAOCamera(ip, port, yuv422!=0);
                 capture = camera;
             }
         }
@@ -82,19 +96,23 @@ int main(void)
     vector<double> num = {0.87};
     vector<double> den = {1, -0.13};
     ColorHistBackProject ltifilt(colorCode, hSize);
+    ltifilt.preprocessMode = preprocessMode;
     ProcessingElement *generalPtr = static_cast<ProcessingElement*>(&ltifilt);
     pipeline.push_back(generalPtr);
     
     ColorHistBackProject seg(colorCode, hSize);
+    seg.preprocessMode = preprocessMode;
     generalPtr = static_cast<ProcessingElement*>(&seg);
     pipeline.push_back(generalPtr);
     
     BayesColorHistBackProject bayesSeg(colorCode, hSize);
+    bayesSeg.preprocessMode = preprocessMode;
     generalPtr = static_cast<ProcessingElement*>(&bayesSeg);
     pipeline.push_back(generalPtr);
     
     int hSize2[] = {128, 128};
     GMMColorHistBackProject GMMSeg(colorCode, hSize2);
+    GMMSeg.preprocessMode = preprocessMode;
     generalPtr = static_cast<ProcessingElement*>(&GMMSeg);
     pipeline.push_back(generalPtr);
     
@@ -108,6 +126,10 @@ int main(void)
     pipeline.push_back(generalPtr);
     
     ObjectTracker objtrack;
+    objtrack.quantizedProbability = quantizedProbability;
+    objtrack.onlineGMM = onlineGMM;
+    objtrack.colorLookup = colorLookup;
+    objtrack.modelThreads = modelThreads;
     generalPtr = static_cast<ProcessingElement*>(&objtrack);
     pipeline.push_back(generalPtr);
 
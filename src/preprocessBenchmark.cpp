@@ -0,0 +1,382 @@
+/*
+ * preprocessBenchmark.cpp
+ *
+ * Measures the cost of the ColorHistBackProject preprocessing modes and how
+ * closely their segmentation agrees with the default bilateral filter, and
+ * checks single precision GMM lookup tables against double precision
+ * evaluation of the same models, the fused tracker front end against the
+ * separate blur, color conversion and binning steps, sparse histogram
+ * accumulators against dense ones, and the optional
+ * ObjectTracker modes against its default mode. The color lookup mode is
+ * compared by segmentation agreement, and online GMM adaptation is
+ * timed over the frames and checked for producing finite probabilities.
+ *
+ * Usage: preprocess-benchmark <histogram image> <image directory> [threshold]
+ *
+ * Run without arguments, it only checks the GMM lookup precision and the
+ * sparse histograms on a synthetic image, which needs no image data.
+ */
+
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "boost/filesystem.hpp"
+#include "boost/shared_ptr.hpp"
+#include "ImgProcPipeline.hpp"
+#include "ObjectTracking.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <climits>
+
+using namespace std;
+using namespace cv;
+using namespace boost::filesystem;
+
+static const PreprocessMode modes[] = {PREPROCESS_BILATERAL, PREPROCESS_NONE, PREPROCESS_BOX, PREPROCESS_GAUSSIAN,
+                                       PREPROCESS_BILATERAL_DOWNSAMPLED, PREPROCESS_GUIDED};
+static const char* modeNames[] = {"bilateral", "none", "box", "gaussian", "bilateral/2", "guided"};
+static const int modeCount = 6;
+
+static boost::shared_ptr<ColorHistBackProject> makeElement(int pipeline, const string& histImage){
+    int hSize[] = {32,32};
+    int hSize2[] = {128,128};
+    int colorCode = CV_BGR2HLS;
+    switch (pipeline){
+    case 0:
+        return boost::shared_ptr<ColorHistBackProject>(new ColorHistBackProject(colorCode, hSize, histImage));
+    case 1:
+        return boost::shared_ptr<ColorHistBackProject>(new BayesColorHistBackProject(colorCode, hSize, histImage));
+    default:
+        return boost::shared_ptr<ColorHistBackProject>(new GMMColorHistBackProject(colorCode, hSize2, histImage));
+    }
+}
+
+/* largest lookup table error allowed, below the step of the 8-bit quantized histograms*/
+static const double lookupTolerance = 1e-3;
+
+/* fits a GMM to the Cr/Cb histogram of the image and compares its lookup table with the double precision model value
+   at every bin center, returns false if the difference exceeds lookupTolerance*/
+static bool checkLookupPrecision(const Mat image, int bins){
+    Mat ycrcb;
+    cvtColor(image, ycrcb, CV_BGR2YCrCb);
+    int channels[] = {1,2};
+    int histSize[] = {bins,bins};
+    float range[] = {0,256};
+    Histogram hist(channels, histSize, range, range);
+    hist.fromImage(ycrcb, Mat());
+    hist.makeGMM(3, 20, 0.001);
+    GaussianMixtureModel model = hist.model();
+
+    int64 start = getTickCount();
+    model.makeLookup(histSize, range, range);
+    double ms = 1000.0*(getTickCount()-start)/getTickFrequency();
+
+    Mat reference(bins, bins, CV_64F);
+    double step = 256.0/bins;
+    for (int i=0; i<bins; i++){
+        for (int j=0; j<bins; j++){
+            double xarr[] = {step/2+i*step, step/2+j*step};
+            Mat x(2,1,CV_64F, xarr);
+            reference.at<double>(i,j) = model.get(x);
+        }
+    }
+    double refMin = 0;
+    double refMax = 0;
+    minMaxLoc(reference, &refMin, &refMax, NULL, NULL);
+    reference.convertTo(reference, CV_64F, 1/(refMax-refMin), -refMin/(refMax-refMin));
+
+    Mat lookup;
+    model.lookup.convertTo(lookup, CV_64F);
+    double maxError = norm(lookup, reference, NORM_INF);
+    bool passed = maxError<=lookupTolerance;
+    std::cout << "  " << std::setw(4) << bins << "x" << std::setw(4) << std::left << bins << std::right << std::fixed
+              << std::setprecision(3) << std::setw(9) << ms << " ms/lookup" << std::scientific << std::setprecision(2)
+              << std::setw(11) << maxError << " max error" << (passed ? "" : "  FAILED") << std::endl;
+    std::cout.unsetf(std::ios::floatfield);
+    return passed;
+}
+
+/* makes a noisy image of three color regions, so the lookup precision can be checked without any image data*/
+static Mat syntheticImage(){
+    Mat image(240, 320, CV_8UC3);
+    RNG rng(0x4e414f47);
+    const Rect regions[] = {Rect(0,0,160,240), Rect(160,0,160,120), Rect(160,120,160,120)};
+    const Scalar colors[] = {Scalar(40,120,200), Scalar(180,90,60), Scalar(70,200,90)};
+    for (int i=0; i<3; i++){
+        Mat region = image(regions[i]);
+        rng.fill(region, RNG::NORMAL, colors[i], Scalar::all(15));
+    }
+    return image;
+}
+
+/* bins the frames with blur, cvtColor and a BinIndexer as well as with blurYCrCbBins, returns false if any bin differs*/
+static bool checkFusedBins(const vector<Mat>& frames, int bins){
+    int channels[] = {1,2};
+    int histSize[] = {bins,bins};
+    float range[] = {0,256};
+    Ptr<BinIndexer> indexer = BinIndexer::create(channels, histSize, range, range);
+
+    double separateTicks = 0;
+    double fusedTicks = 0;
+    int mismatches = 0;
+    for (size_t i=0; i<frames.size(); i++){
+        Mat blurred;
+        Mat reference;
+        int64 start = getTickCount();
+        blur(frames[i], blurred, Size(5,5));
+        cvtColor(blurred, blurred, CV_BGR2YCrCb);
+        indexer->binIndices(blurred, reference);
+        separateTicks += (double)(getTickCount()-start);
+
+        Mat fused;
+        start = getTickCount();
+        blurYCrCbBins(frames[i], bins, fused);
+        fusedTicks += (double)(getTickCount()-start);
+
+        mismatches += (int)(reference.total()-countNonZero(reference==fused));
+    }
+    double toMs = 1000.0/getTickFrequency()/frames.size();
+    std::cout << "  " << std::setw(4) << bins << "x" << std::setw(4) << std::left << bins << std::right << std::fixed
+              << std::setprecision(2) << std::setw(9) << separateTicks*toMs << " ms/frame separate"
+              << std::setw(9) << fusedTicks*toMs << " ms/frame fused" << std::setw(9) << mismatches << " differing bins"
+              << (mismatches==0 ? "" : "  FAILED") << std::endl;
+    return mismatches==0;
+}
+
+/* builds the Cr/Cb histogram of the first frame and updates it with the others, once with a dense and once with a
+   sparse accumulator, returns false if the normalized histograms differ by more than lookupTolerance*/
+static bool checkSparseHistogram(const vector<Mat>& frames, int bins){
+    int channels[] = {1,2};
+    int histSize[] = {bins,bins};
+    float range[] = {0,256};
+    vector<Mat> ycrcb(frames.size());
+    for (size_t i=0; i<frames.size(); i++){
+        cvtColor(frames[i], ycrcb[i], CV_BGR2YCrCb);
+    }
+
+    Histogram dense(channels, histSize, range, range);
+    dense.sparseMinBins = INT_MAX;
+    Histogram sparse(channels, histSize, range, range);
+    sparse.sparseMinBins = 0;
+    double denseTicks = 0;
+    double sparseTicks = 0;
+    double maxError = 0;
+    for (size_t i=0; i<ycrcb.size(); i++){
+        int64 start = getTickCount();
+        dense.update(ycrcb[i], 0.1, Mat());
+        denseTicks += (double)(getTickCount()-start);
+        start = getTickCount();
+        sparse.update(ycrcb[i], 0.1, Mat());
+        sparseTicks += (double)(getTickCount()-start);
+        maxError = max(maxError, norm(dense.normalized, sparse.normalized, NORM_INF));
+    }
+    bool passed = maxError<=lookupTolerance;
+    double toMs = 1000.0/getTickFrequency()/ycrcb.size();
+    std::cout << "  " << std::setw(4) << bins << "x" << std::setw(4) << std::left << bins << std::right << std::fixed
+              << std::setprecision(3) << std::setw(9) << denseTicks*toMs << " ms/update dense"
+              << std::setw(9) << sparseTicks*toMs << " ms/update sparse" << std::scientific << std::setprecision(2)
+              << std::setw(11) << maxError << " max error" << (passed ? "" : "  FAILED") << std::endl;
+    std::cout.unsetf(std::ios::floatfield);
+    return passed;
+}
+
+/* largest difference allowed between 8-bit and floating point probability images, one quantization step*/
+static const double quantizedTolerance = 1.0/255;
+
+/* trains one object kind on the histogram image, with the first frame as background*/
+static void trainTracker(ObjectTracker& tracker, const Mat modelImage, const Mat background){
+    vector<Mat> images;
+    vector<Mat> masks;
+    images.push_back(modelImage);
+    masks.push_back(Mat(modelImage.size(), CV_8U, Scalar(255)));
+    images.push_back(background);
+    masks.push_back(Mat::zeros(background.size(), CV_8U));
+    tracker.addObjectKind(images, masks);
+}
+
+/* computes the probability images of the tracker's first kind for every frame as CV_32F, returns ms/frame*/
+static double trackerProbabilities(ObjectTracker& tracker, const vector<Mat>& frames, vector<Mat>& probabilities){
+    double ticks = 0;
+    probabilities.clear();
+    for (size_t i=0; i<frames.size(); i++){
+        Mat binImage;
+        vector<Mat> probImages;
+        int64 start = getTickCount();
+        tracker.probabilityImages(frames[i], binImage, probImages);
+        ticks += (double)(getTickCount()-start);
+        Mat probability;
+        probImages[0].convertTo(probability, CV_32F, probImages[0].depth()==CV_8U ? 1/255.0 : 1.0);
+        probabilities.push_back(probability);
+    }
+    return 1000.0*ticks/getTickFrequency()/frames.size();
+}
+
+/* runs the optional tracker modes against the default mode, returns false if a mode which should match it does not.
+   Modes that approximate the default mode report how many pixels they segment the same way at threshold*/
+static bool checkTrackerModes(const Mat modelImage, const vector<Mat>& frames, float threshold){
+    bool passed = true;
+    ObjectTracker reference;
+    trainTracker(reference, modelImage, frames[0]);
+    vector<Mat> referenceProbabilities;
+    double referenceMs = trackerProbabilities(reference, frames, referenceProbabilities);
+    std::cout << "  " << std::setw(12) << "default" << std::fixed << std::setprecision(2) << std::setw(9) << referenceMs
+              << " ms/frame" << std::endl;
+
+    ObjectTracker quantized;
+    quantized.quantizedProbability = true;
+    trainTracker(quantized, modelImage, frames[0]);
+    vector<Mat> quantizedProbabilities;
+    double quantizedMs = trackerProbabilities(quantized, frames, quantizedProbabilities);
+    double maxError = 0;
+    for (size_t i=0; i<frames.size(); i++){
+        maxError = max(maxError, norm(quantizedProbabilities[i], referenceProbabilities[i], NORM_INF));
+    }
+    bool quantizedPassed = maxError<=quantizedTolerance;
+    passed = passed && quantizedPassed;
+    std::cout << "  " << std::setw(12) << "quantized" << std::setw(9) << quantizedMs << " ms/frame" << std::scientific
+              << std::setprecision(2) << std::setw(11) << maxError << " max error" << (quantizedPassed ? "" : "  FAILED") << std::endl;
+    std::cout.unsetf(std::ios::floatfield);
+
+    //the color lookup quantizes BGR colors before binning, so it is compared by segmentation rather than by error
+    ObjectTracker lookup;
+    lookup.colorLookup = true;
+    trainTracker(lookup, modelImage, frames[0]);
+    vector<Mat> lookupProbabilities;
+    double lookupMs = trackerProbabilities(lookup, frames, lookupProbabilities);
+    double agreeing = 0;
+    double total = 0;
+    for (size_t i=0; i<frames.size(); i++){
+        Mat segmented = lookupProbabilities[i]>threshold;
+        agreeing += countNonZero(segmented==(referenceProbabilities[i]>threshold));
+        total += segmented.total();
+    }
+    std::cout << "  " << std::setw(12) << "color lookup" << std::fixed << std::setprecision(2) << std::setw(9) << lookupMs
+              << " ms/frame" << std::setw(9) << 100.0*agreeing/total << " % agreement" << std::endl;
+
+    //online GMM adaptation changes the model, so it is checked for staying finite rather than against the default mode
+    ObjectTracker online;
+    online.onlineGMM = true;
+    trainTracker(online, modelImage, frames[0]);
+    double ticks = 0;
+    for (size_t i=0; i<frames.size(); i++){
+        Mat output;
+        int64 start = getTickCount();
+        online.process(frames[i], &output);
+        ticks += (double)(getTickCount()-start);
+    }
+    double onlineMs = 1000.0*ticks/getTickFrequency()/frames.size();
+    vector<Mat> onlineProbabilities;
+    trackerProbabilities(online, frames, onlineProbabilities);
+    bool onlinePassed = true;
+    for (size_t i=0; i<frames.size(); i++){
+        onlinePassed = onlinePassed && checkRange(onlineProbabilities[i]);
+    }
+    passed = passed && onlinePassed;
+    std::cout << "  " << std::setw(12) << "online GMM" << std::fixed << std::setprecision(2) << std::setw(9) << onlineMs
+              << " ms/frame" << std::setw(6) << online.objectKinds[0].scheduler.performedUpdates << " updates"
+              << (onlinePassed ? "" : "  FAILED") << std::endl;
+    return passed;
+}
+
+int main(int argc, char** argv){
+    int lookupSizes[] = {32, 64, 128};
+    int sparseSizes[] = {64, 128, 256};
+    if (argc<3){
+        std::cout << "Usage: " << argv[0] << " <histogram image> <image directory> [threshold]" << std::endl;
+        std::cout << "Without arguments only the checks that need no image data are run" << std::endl;
+        if (argc>1){
+            return 1;
+        }
+        std::cout << "GMM lookup precision (synthetic image)" << std::endl;
+        Mat synthetic = syntheticImage();
+        bool passed = true;
+        for (int i=0; i<3; i++){
+            passed = checkLookupPrecision(synthetic, lookupSizes[i]) && passed;
+        }
+        std::cout << "Sparse histograms (synthetic image)" << std::endl;
+        vector<Mat> syntheticFrames(1, synthetic);
+        for (int i=0; i<3; i++){
+            passed = checkSparseHistogram(syntheticFrames, sparseSizes[i]) && passed;
+        }
+        return passed ? 0 : 2;
+    }
+    string histImage = argv[1];
+    path imageDir(argv[2]);
+    float threshold = argc>3 ? (float)atof(argv[3]) : 0.2f;
+
+    vector<Mat> frames;
+    if (exists(imageDir) && is_directory(imageDir)){
+        directory_iterator end_itr;
+        for (directory_iterator itr(imageDir); itr!=end_itr; ++itr){
+            Mat img = imread(itr->path().string());
+            if (!img.empty()){
+                frames.push_back(img);
+            }
+        }
+    }
+    if (frames.empty()){
+        std::cout << "No images found in " << imageDir.string() << std::endl;
+        return 1;
+    }
+    std::cout << "Loaded " << frames.size() << " images" << std::endl;
+
+    Mat modelImage = imread(histImage);
+    const char* pipelineNames[] = {"ColorHistBackProject", "BayesColorHistBackProject", "GMMColorHistBackProject"};
+    for (int p=0; p<3; p++){
+        std::cout << pipelineNames[p] << std::endl;
+        vector<Mat> reference;
+        for (int m=0; m<modeCount; m++){
+            //the constructor trains with the default mode, so the histogram is retrained with the mode under test
+            boost::shared_ptr<ColorHistBackProject> element = makeElement(p, histImage);
+            element->preprocessMode = modes[m];
+            element->histFromImage(modelImage);
+
+            double ticks = 0;
+            double agreeing = 0;
+            double total = 0;
+            for (size_t i=0; i<frames.size(); i++){
+                Mat output;
+                int64 start = getTickCount();
+                element->process(frames[i], &output);
+                ticks += (double)(getTickCount()-start);
+
+                Mat segmented = output>threshold;
+                if (m==0){
+                    reference.push_back(segmented);
+                }
+                else {
+                    agreeing += countNonZero(segmented==reference[i]);
+                }
+                total += segmented.total();
+            }
+            double msPerFrame = 1000.0*ticks/getTickFrequency()/frames.size();
+            std::cout << "  " << std::setw(12) << modeNames[m] << std::fixed << std::setprecision(2)
+                      << std::setw(9) << msPerFrame << " ms/frame";
+            if (m>0){
+                std::cout << std::setw(9) << 100.0*agreeing/total << " % agreement";
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    std::cout << "GMM lookup precision" << std::endl;
+    bool passed = true;
+    for (int i=0; i<3; i++){
+        passed = checkLookupPrecision(modelImage, lookupSizes[i]) && passed;
+    }
+
+    std::cout << "Sparse histograms" << std::endl;
+    for (int i=0; i<3; i++){
+        passed = checkSparseHistogram(frames, sparseSizes[i]) && passed;
+    }
+
+    std::cout << "Tracker front end" << std::endl;
+    for (int i=0; i<3; i++){
+        passed = checkFusedBins(frames, lookupSizes[i]) && passed;
+    }
+
+    std::cout << "Tracker modes" << std::endl;
+    passed = checkTrackerModes(modelImage, frames, threshold) && passed;
+    return passed ? 0 : 2;
+}